@@ -1,10 +1,23 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "FILE.h"
 #include "compression.h"
 #include "encryption.h"
 
+/* Bytes of the mapped diary.enc decrypted in place at a time while
+ * loading; a whole number of pages */
+#define LOAD_WINDOW_SIZE (1024 * 1024)
+
+/* Bytes encrypted and written at a time while saving */
+#define SAVE_CHUNK_SIZE (64 * 1024)
+
 /* Duplicate a string */
 static char *xstrdup(const char *s) {
     size_t n;
@@ -89,59 +102,107 @@ static int countWrds(const char *s) {
     return count;
 }
 
-/* Convert linked list to text string for saving */
-static char* serializeEntries(const DiaryEntry* head, size_t* outSize) {
+/* Length of the text serializeEntries writes for these entries */
+static size_t serializedSize(const DiaryEntry* const* entries, size_t count) {
     const DiaryEntry* cur;
     size_t totalSize = 0;
-    char* result;
-    char* ptr;
+    size_t i;
     
-    /* Calculate how much space we need */
-    for (cur = head; cur; cur = cur->next) {
+    for (i = 0; i < count; i++) {
+        cur = entries[i];
         totalSize += strlen("ENTRY_START\n");
         totalSize += strlen("DATE:") + strlen(cur->datetime) + 1;
         totalSize += strlen("CONTENT:") + strlen(cur->content) + 1;
-        totalSize += strlen("WORDCOUNT:") + 20 + 1;
+        totalSize += (size_t)snprintf(NULL, 0, "WORDCOUNT:%d\n", cur->wordCount);
         totalSize += strlen("ENTRY_END\n");
     }
+    return totalSize;
+}
+
+/* Write entries as text into a compression stream, one field at a time,
+ * so the whole text never exists at once */
+static int serializeEntries(const DiaryEntry* const* entries, size_t count,
+                            struct compress_stream* stream) {
+    const DiaryEntry* cur;
+    char line[64];
+    size_t i;
+    int n;
     
-    result = malloc(totalSize + 1);
-    if (!result) {
-        *outSize = 0;
-        return NULL;
-    }
-    
-    /* Write all entries to string */
-    ptr = result;
-    for (cur = head; cur; cur = cur->next) {
-        ptr += sprintf(ptr, "ENTRY_START\n");
-        ptr += sprintf(ptr, "DATE:%s\n", cur->datetime);
-        ptr += sprintf(ptr, "CONTENT:%s\n", cur->content);
-        ptr += sprintf(ptr, "WORDCOUNT:%d\n", cur->wordCount);
-        ptr += sprintf(ptr, "ENTRY_END\n");
+    for (i = 0; i < count; i++) {
+        cur = entries[i];
+        n = snprintf(line, sizeof(line), "\nWORDCOUNT:%d\nENTRY_END\n", cur->wordCount);
+        if (compress_stream_write(stream, "ENTRY_START\nDATE:", 17) != 0 ||
+            compress_stream_write(stream, cur->datetime, strlen(cur->datetime)) != 0 ||
+            compress_stream_write(stream, "\nCONTENT:", 9) != 0 ||
+            compress_stream_write(stream, cur->content, strlen(cur->content)) != 0 ||
+            compress_stream_write(stream, line, (size_t)n) != 0) {
+            return -1;
+        }
     }
-    
-    *outSize = ptr - result;
-    return result;
+    return 0;
 }
 
-/* Convert text string back to linked list */
-static DiaryEntry* deserializeEntries(const char* data, size_t dataSize) {
-    DiaryEntry* head = NULL;
-    const char* ptr = data;
-    const char* end = data + dataSize;
+/* Compression sink for saving: encrypt each piece at its file offset and
+ * hand it to buffered file output */
+typedef struct {
+    FILE* file;
+    const char* key;
+    unsigned long long offset;
+    char* chunk;
+} EncryptWriter;
+
+static int encryptSink(void* ctx, const void* data, size_t len) {
+    EncryptWriter* writer = ctx;
+    const char* p = data;
     
-    if (!data || dataSize == 0) {
-        printf("ERROR: Invalid data for deserialization\n");
-        return NULL;
+    while (len > 0) {
+        size_t take = len < SAVE_CHUNK_SIZE ? len : SAVE_CHUNK_SIZE;
+        memcpy(writer->chunk, p, take);
+        xorEncryptAt(writer->chunk, take, writer->key, writer->offset);
+        if (fwrite(writer->chunk, 1, take, writer->file) != take) return -1;
+        writer->offset += take;
+        p += take;
+        len -= take;
     }
+    return 0;
+}
+
+/* Compression sink that collects a block body in memory, so its size is
+ * known before deciding where it goes */
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+} MemoryWriter;
+
+static int memorySink(void* ctx, const void* data, size_t len) {
+    MemoryWriter* out = ctx;
     
-    if (strstr(data, "ENTRY_START") == NULL) {
-        printf("ERROR: No valid entry markers found in data\n");
-        return NULL;
+    if (out->size + len > out->capacity) {
+        size_t cap = out->capacity ? out->capacity : 4096;
+        char* grown;
+        while (cap < out->size + len) cap *= 2;
+        grown = realloc(out->data, cap);
+        if (!grown) return -1;
+        out->data = grown;
+        out->capacity = cap;
     }
+    memcpy(out->data + out->size, data, len);
+    out->size += len;
+    return 0;
+}
+
+/* True if the bytes at p, before end, start with lit */
+static int startsWith(const char* p, const char* end, const char* lit) {
+    size_t n = strlen(lit);
+    return (size_t)(end - p) >= n && memcmp(p, lit, n) == 0;
+}
+
+/* Parse the entries in data up to end and add them to head */
+static void parseEntries(const char* data, const char* end, DiaryEntry** head) {
+    const char* ptr = data;
     
-    /* Walk through the string and parse entries */
+    /* Walk through the text and parse entries */
     while (ptr < end) {
         /* Skip whitespace */
         while (ptr < end && (*ptr == '\n' || *ptr == '\r' || *ptr == ' ')) {
@@ -151,7 +212,7 @@ static DiaryEntry* deserializeEntries(const char* data, size_t dataSize) {
         if (ptr >= end) break;
         
         /* Found start of an entry */
-        if (strncmp(ptr, "ENTRY_START", 11) == 0) {
+        if (startsWith(ptr, end, "ENTRY_START")) {
             ptr += 11;
             
             char datetime[256] = {0};
@@ -166,12 +227,12 @@ static DiaryEntry* deserializeEntries(const char* data, size_t dataSize) {
                 if (ptr >= end) break;
                 
                 /* Check what field this is */
-                if (strncmp(ptr, "ENTRY_END", 9) == 0) {
+                if (startsWith(ptr, end, "ENTRY_END")) {
                     ptr += 9;
                     break;
                 }
                 
-                if (strncmp(ptr, "DATE:", 5) == 0) {
+                if (startsWith(ptr, end, "DATE:")) {
                     ptr += 5;
                     size_t i = 0;
                     while (ptr < end && *ptr != '\n' && *ptr != '\r' && i < sizeof(datetime) - 1) {
@@ -180,7 +241,7 @@ static DiaryEntry* deserializeEntries(const char* data, size_t dataSize) {
                     datetime[i] = '\0';
                     foundDate = 1;
                 }
-                else if (strncmp(ptr, "CONTENT:", 8) == 0) {
+                else if (startsWith(ptr, end, "CONTENT:")) {
                     ptr += 8;
                     size_t i = 0;
                     while (ptr < end && *ptr != '\n' && *ptr != '\r' && i < sizeof(content) - 1) {
@@ -189,10 +250,12 @@ static DiaryEntry* deserializeEntries(const char* data, size_t dataSize) {
                     content[i] = '\0';
                     foundContent = 1;
                 }
-                else if (strncmp(ptr, "WORDCOUNT:", 10) == 0) {
+                else if (startsWith(ptr, end, "WORDCOUNT:")) {
                     ptr += 10;
-                    wordCount = atoi(ptr);
-                    while (ptr < end && *ptr != '\n' && *ptr != '\r') ptr++;
+                    while (ptr < end && *ptr != '\n' && *ptr != '\r') {
+                        if (*ptr >= '0' && *ptr <= '9') wordCount = wordCount * 10 + (*ptr - '0');
+                        ptr++;
+                    }
                 }
                 else {
                     /* Unknown field, skip it */
@@ -205,7 +268,7 @@ static DiaryEntry* deserializeEntries(const char* data, size_t dataSize) {
                 DiaryEntry* entry = createEntry(datetime, content);
                 if (entry) {
                     entry->wordCount = wordCount;
-                    addEntry(&head, entry);
+                    addEntry(head, entry);
                 }
             }
         }
@@ -213,46 +276,108 @@ static DiaryEntry* deserializeEntries(const char* data, size_t dataSize) {
             ptr++;
         }
     }
-    
-    return head;
 }
 
-/* Read entire file into memory */
+/* Builds the entry list from decompressed text handed over a piece at a
+ * time; only the unfinished entry at the end of a piece is kept back */
+typedef struct {
+    DiaryEntry* head;
+    char* tail;              /* start of an entry the next piece finishes */
+    size_t tailLen;
+    size_t tailCap;
+    size_t total;
+} EntryParser;
+
+/* Offset just past the last "ENTRY_END" line of data, looking no further
+ * back than from; 0 if there is none */
+static size_t lastEntryEnd(const char* data, size_t from, size_t size) {
+    size_t i;
+
+    if (size < 10) return 0;
+    for (i = size - 10 + 1; i-- > from;) {
+        if (data[i + 9] == '\n' && memcmp(data + i, "ENTRY_END", 9) == 0 &&
+            (i == 0 || data[i - 1] == '\n' || data[i - 1] == '\r')) {
+            return i + 10;
+        }
+    }
+    return 0;
+}
+
+/* Keep len bytes as the unfinished tail */
+static int keepTail(EntryParser* parser, const char* data, size_t len) {
+    if (len == 0) return 0;
+    if (parser->tailLen + len > parser->tailCap) {
+        size_t cap = parser->tailCap ? parser->tailCap : 4096;
+        char* grown;
+        while (cap < parser->tailLen + len) cap *= 2;
+        grown = realloc(parser->tail, cap);
+        if (!grown) return -1;
+        parser->tail = grown;
+        parser->tailCap = cap;
+    }
+    memcpy(parser->tail + parser->tailLen, data, len);
+    parser->tailLen += len;
+    return 0;
+}
+
+/* Decompression sink: parse every entry the new piece completes */
+static int parseSink(void* ctx, const void* data, size_t len) {
+    EntryParser* parser = ctx;
+    const char* text = data;
+    size_t cut;
+
+    parser->total += len;
+    if (parser->tailLen == 0) {
+        /* nothing held back: parse straight out of the decoded block */
+        cut = lastEntryEnd(text, 0, len);
+        parseEntries(text, text + cut, &parser->head);
+        return keepTail(parser, text + cut, len - cut);
+    }
+
+    cut = parser->tailLen > 9 ? parser->tailLen - 9 : 0;
+    if (keepTail(parser, text, len) != 0) return -1;
+    cut = lastEntryEnd(parser->tail, cut, parser->tailLen);
+    if (cut > 0) {
+        parseEntries(parser->tail, parser->tail + cut, &parser->head);
+        memmove(parser->tail, parser->tail + cut, parser->tailLen - cut);
+        parser->tailLen -= cut;
+    }
+    return 0;
+}
+
+/* Read entire file into memory, sized by fstat on the one descriptor */
 char* readFile(const char* filename) {
-    FILE *filep = fopen(filename, "rb");
-    long size;
+    struct stat st;
     char *buffer;
-    size_t readn;
-    
-    if (!filep) { 
-        perror("fopen");
-        return NULL; 
-    }
+    size_t size, readn = 0;
+    ssize_t got;
+    int fd;
 
-    if (fseek(filep, 0, SEEK_END) != 0) { 
-        perror("fseek"); 
-        fclose(filep); 
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) { 
+        perror("open");
         return NULL; 
     }
-    
-    size = ftell(filep);
-    if (size < 0) { 
-        perror("ftell"); 
-        fclose(filep); 
+
+    if (fstat(fd, &st) != 0) { 
+        perror("fstat"); 
+        close(fd); 
         return NULL; 
     }
-    rewind(filep);
+    size = (size_t)st.st_size;
 
-    buffer = (char*) malloc((size_t)size + 1);
+    buffer = (char*) malloc(size + 1);
     if (!buffer) { 
         perror("malloc"); 
-        fclose(filep); 
+        close(fd); 
         return NULL; 
     }
 
-    readn = fread(buffer, 1, (size_t)size, filep);
+    while (readn < size && (got = read(fd, buffer + readn, size - readn)) > 0) {
+        readn += (size_t)got;
+    }
     buffer[readn] = '\0';
-    fclose(filep);
+    close(fd);
     return buffer;
 }
 
@@ -271,32 +396,23 @@ int writeFile(const char* filename, const char* data, size_t dataSize){
     return written == dataSize;
 }
 
-/* Check if file exists */
+/* Check if file exists, without opening it */
 int fileExists(const char* filename) {
-    FILE *filep = fopen(filename, "rb");
-    if (!filep) { 
+    struct stat st;
+
+    if (stat(filename, &st) != 0) { 
         perror("fileExists");
         return 0; 
     }
-    fclose(filep);
     return 1;
 }
 
 /* Get file size in bytes */
 long getFileSize(const char* filename) {
-    FILE* filep = fopen(filename, "rb");
-    long size;
-
-    if (!filep) { return -1; }
+    struct stat st;
 
-    if (fseek(filep, 0, SEEK_END) != 0) { 
-        fclose(filep); 
-        return -1; 
-    }
-    size = ftell(filep);
-
-    fclose(filep);
-    return size;
+    if (stat(filename, &st) != 0) { return -1; }
+    return (long)st.st_size;
 }
 
 /* Create a new diary entry */
@@ -315,6 +431,8 @@ DiaryEntry* createEntry(const char* datetime, const char* content) {
     }
     
     entry->wordCount = countWrds(entry->content);
+    entry->block = -1;
+    entry->dirty = 1;
     entry->next = NULL;
     
     return entry;
@@ -342,18 +460,11 @@ void freeAllEntries(DiaryEntry* head) {
     }
 }
 
-/* Delete entry by datetime */
-void delEntry(DiaryEntry** head, const char* datetime) {
-    DiaryEntry *cur, *prev;
+/* Unlink and free the first entry with this datetime; 1 if there was one */
+static int removeEntry(DiaryEntry** head, const char* datetime) {
+    DiaryEntry *cur, *prev = NULL;
 
-    if (!head || !*head || !datetime) { 
-        return; 
-    }
-
-    cur = *head;
-    prev = NULL;
-
-    while (cur) {
+    for (cur = *head; cur; prev = cur, cur = cur->next) {
         if (strcmp(cur->datetime, datetime) == 0) {
             if (prev) { 
                 prev->next = cur->next; 
@@ -364,141 +475,673 @@ void delEntry(DiaryEntry** head, const char* datetime) {
             free(cur->datetime);
             free(cur->content);
             free(cur);
-            
-            printf("✓ Deleted entry from %s\n", datetime);
-            return;
+            return 1;
         }
-        prev = cur;
-        cur = cur->next;
     }
-    
-    printf("✗ No entry found for %s\n", datetime);
+    return 0;
 }
 
-/* Save all entries to encrypted file */
-int saveAllEntries(const DiaryEntry* head, const char* filename, const char* key) {
-    char* serialized;
-    size_t serializedSize;
-    char* compressed;
-    size_t compressedSize;
-    char* encrypted;
-    size_t encryptedSize;
-    int result;
-    
-    /* Convert to text */
-    serialized = serializeEntries(head, &serializedSize);
-    if (!serialized) {
-        printf("Failed to serialize entries\n");
-        return -1;
+/* Unlink and free every entry read from block id */
+static void dropBlockEntries(DiaryEntry** head, int id) {
+    DiaryEntry** link = head;
+    DiaryEntry* cur;
+
+    while ((cur = *link)) {
+        if (cur->block == id) {
+            *link = cur->next;
+            free(cur->datetime);
+            free(cur->content);
+            free(cur);
+        } else {
+            link = &cur->next;
+        }
     }
-    
-    /* Compress */
-    compressed = compress(serialized, &compressedSize);
-    free(serialized);
-    
-    if (!compressed) {
-        printf("Failed to compress data\n");
-        return -1;
+}
+
+/* Delete entry by datetime */
+void delEntry(DiaryEntry** head, const char* datetime) {
+    DiaryEntry* cur;
+
+    if (!head || !*head || !datetime) { 
+        return; 
     }
-    
-    /* Encrypt */
-    encryptedSize = compressedSize;
-    encrypted = malloc(encryptedSize);
-    if (!encrypted) {
-        free(compressed);
+
+    /* datetime may be the entry's own string, so report before freeing */
+    for (cur = *head; cur && strcmp(cur->datetime, datetime) != 0; cur = cur->next) {}
+    if (cur) {
+        printf("✓ Deleted entry from %s\n", datetime);
+        removeEntry(head, datetime);
+    } else {
+        printf("✗ No entry found for %s\n", datetime);
+    }
+}
+
+/* Key check header: magic, version, salt, then the check derived from salt
+ * and key. The records follow, their keystream counted from the start of
+ * the file */
+static void writeDiaryHeader(unsigned char* out, const char* key) {
+    memcpy(out, DIARY_MAGIC, 4);
+    out[4] = DIARY_HEADER_VERSION;
+    generateSalt(out + 5);
+    deriveKeyCheck(key, out + 5, out + 5 + KEY_SALT_SIZE);
+}
+
+/* 1 if header holds a key check that key passes, 0 if it fails, -1 if
+ * header is not a key check header */
+static int verifyDiaryHeader(const unsigned char* header, size_t size, const char* key) {
+    unsigned char check[KEY_CHECK_SIZE];
+
+    if (size < DIARY_HEADER_SIZE || memcmp(header, DIARY_MAGIC, 4) != 0 ||
+        (header[4] != DIARY_HEADER_VERSION && header[4] != DIARY_SNAPSHOT_VERSION)) {
         return -1;
     }
-    memcpy(encrypted, compressed, encryptedSize);
-    xorEncrypt(encrypted, encryptedSize, key);
-    free(compressed);
-    
-    /* Write to file */
-    result = writeFile(filename, encrypted, encryptedSize);
-    free(encrypted);
-    
-    return result ? 0 : -1;
+    deriveKeyCheck(key, header + 5, check);
+    return keyCheckMatches(check, header + 5 + KEY_SALT_SIZE);
 }
 
-/* Load all entries from encrypted file */
-DiaryEntry* loadAllEntries(const char* filename, const char* key) {
-    long fileSize;
+/* Check a key against the header of an encrypted diary without reading the
+ * rest. A file from before the header existed has none to check; there the
+ * key has to decrypt the start of the file to a container or old format
+ * buffer */
+int checkDiaryKey(const char* filename, const char* key) {
+    unsigned char header[DIARY_HEADER_SIZE];
+    size_t got;
     FILE* file;
-    char* encrypted;
-    char* decrypted;
-    char* decompressed;
-    DiaryEntry* entries;
-    
-    /* Get file size */
-    fileSize = getFileSize(filename);
-    if (fileSize <= 0) {
-        printf("Failed to get file size\n");
-        return NULL;
-    }
-    
-    printf("Loading diary file (%ld bytes)...\n", fileSize);
-    
-    /* Read file */
+    int result;
+
+    if (!key) { return 0; }
     file = fopen(filename, "rb");
-    if (!file) {
-        printf("Failed to open file\n");
-        return NULL;
+    if (!file) { return -1; }
+    got = fread(header, 1, sizeof(header), file);
+    fclose(file);
+    result = verifyDiaryHeader(header, got, key);
+    if (result == -1 && got >= LEGACY_PREFIX_SIZE) {
+        xorDecryptAt((char*)header, got, key, 0);
+        result = memcmp(header, COMPRESS_MAGIC, 4) == 0 || is_legacy_compressed(header, got);
     }
-    
-    encrypted = malloc(fileSize);
-    if (!encrypted) {
+    return result;
+}
+
+/* Open a diary log for key, positioned just past its header; NULL if the
+ * file is missing, not a log or the key is wrong */
+static FILE* openDiaryLog(const char* filename, const char* key, const char* mode) {
+    unsigned char header[DIARY_HEADER_SIZE];
+    size_t got;
+    FILE* file;
+
+    if (!key) { return NULL; }
+    file = fopen(filename, mode);
+    if (!file) { return NULL; }
+    got = fread(header, 1, sizeof(header), file);
+    if (verifyDiaryHeader(header, got, key) != 1 || header[4] != DIARY_HEADER_VERSION) {
         fclose(file);
         return NULL;
     }
-    
-    size_t bytesRead = fread(encrypted, 1, fileSize, file);
-    fclose(file);
-    
-    if (bytesRead != (size_t)fileSize) {
-        printf("Failed to read complete file\n");
-        free(encrypted);
-        return NULL;
+    return file;
+}
+
+/* Record header: type byte, then the body length as u64 little endian */
+static void putRecordHeader(unsigned char* out, int type, unsigned long long length) {
+    int i;
+    out[0] = (unsigned char)type;
+    for (i = 0; i < 8; i++) {
+        out[1 + i] = (unsigned char)(length >> (8 * i));
+    }
+}
+
+static unsigned long long getRecordLength(const unsigned char* in) {
+    unsigned long long length = 0;
+    int i;
+    for (i = 7; i >= 0; i--) {
+        length = (length << 8) | in[1 + i];
+    }
+    return length;
+}
+
+/* Slot for block id, growing the table with unwritten slots as needed */
+static DiaryBlock* blockAt(DiaryBlockTable* table, int id) {
+    if (id >= table->capacity) {
+        int cap = table->capacity ? table->capacity : 16;
+        DiaryBlock* grown;
+        while (cap <= id) cap *= 2;
+        grown = realloc(table->blocks, (size_t)cap * sizeof(*grown));
+        if (!grown) return NULL;
+        table->blocks = grown;
+        table->capacity = cap;
+    }
+    while (table->count <= id) {
+        table->blocks[table->count].offset = -1;
+        table->blocks[table->count].entries = 0;
+        table->count++;
+    }
+    return &table->blocks[id];
+}
+
+/* Block body: id (u32), container length (u64), then the compressed
+ * entries. Records written with room to spare hold more than that */
+static int encodeBlock(int id, const DiaryEntry* const* entries, size_t count, MemoryWriter* out) {
+    static const char space[DIARY_BLOCK_PREFIX_SIZE];
+    struct compress_options opts;
+    struct compress_stream stream;
+    unsigned long long used;
+    size_t size = serializedSize(entries, count);
+    int result;
+    int i;
+
+    /* A block is a few KiB: one thread, and a buffer no bigger than it */
+    compress_default_options(&opts);
+    opts.threads = 1;
+    if (opts.block_size > size) opts.block_size = size > 0 ? size : 1;
+
+    out->size = 0;
+    if (memorySink(out, space, sizeof(space)) != 0) return -1;
+    result = compress_stream_init(&stream, &opts, size, memorySink, out);
+    if (result != 0) return -1;
+    result = serializeEntries(entries, count, &stream);
+    if (result == 0) result = compress_stream_finish(&stream);
+    compress_stream_free(&stream);
+    if (result != 0) return -1;
+
+    used = out->size - DIARY_BLOCK_PREFIX_SIZE;
+    for (i = 0; i < 4; i++) out->data[i] = (char)((unsigned)id >> (8 * i));
+    for (i = 0; i < 8; i++) out->data[4 + i] = (char)(used >> (8 * i));
+    return 0;
+}
+
+/* Append an encoded block body as a new record, then mark the record it
+ * replaces free. The old copy is left intact until the new one is flushed,
+ * so a save cut short leaves one or both; replay keeps the later one */
+static int writeBlockRecord(EncryptWriter* writer, DiaryBlockTable* table, DiaryBlock* slot,
+                            const MemoryWriter* body) {
+    unsigned char record[DIARY_RECORD_HEADER_SIZE];
+    long start;
+    long old = slot->offset;
+
+    if (fseek(writer->file, 0, SEEK_END) != 0 || (start = ftell(writer->file)) < 0) return -1;
+    writer->offset = (unsigned long long)start;
+    putRecordHeader(record, DIARY_RECORD_BLOCK, body->size);
+    if (encryptSink(writer, record, sizeof(record)) != 0 ||
+        encryptSink(writer, body->data, body->size) != 0 || fflush(writer->file) != 0) {
+        return -1;
+    }
+    slot->offset = start;
+
+    if (old >= 0) {
+        record[0] = DIARY_RECORD_FREE;
+        writer->offset = (unsigned long long)old;
+        if (fseek(writer->file, old, SEEK_SET) != 0 || encryptSink(writer, record, 1) != 0) {
+            return -1;
+        }
+        table->freed++;
+    }
+    return 0;
+}
+
+/* Write the whole list to a fresh file as blocks of DIARY_BLOCK_ENTRIES
+ * entries in list order. Where each went replaces table once the file is
+ * in place; a failed write marks table loose instead */
+static int writeDiaryFile(const DiaryEntry* head, const char* filename, const char* key,
+                          DiaryBlockTable* table) {
+    unsigned char header[DIARY_HEADER_SIZE];
+    const DiaryEntry* members[DIARY_BLOCK_ENTRIES];
+    DiaryBlockTable fresh = {0};
+    MemoryWriter body = {0};
+    EncryptWriter writer;
+    DiaryBlock* slot;
+    char* tempName;
+    size_t count;
+    int id = 0;
+    int result;
+
+    if (table) table->loose = 1;
+
+    /* Write next to the diary and swap it in once complete, so a failed
+     * save leaves the old file as it was */
+    tempName = malloc(strlen(filename) + 5);
+    if (!tempName) return -1;
+    sprintf(tempName, "%s.tmp", filename);
+
+    writer.file = fopen(tempName, "wb");
+    writer.key = key;
+    writer.chunk = malloc(SAVE_CHUNK_SIZE);
+    if (!writer.file || !writer.chunk) {
+        if (!writer.file) perror("fopen for write");
+        if (writer.file) fclose(writer.file);
+        free(writer.chunk);
+        free(tempName);
+        return -1;
+    }
+
+    writeDiaryHeader(header, key);
+    result = fwrite(header, 1, sizeof(header), writer.file) == sizeof(header) ? 0 : -1;
+    while (result == 0 && head) {
+        for (count = 0; head && count < DIARY_BLOCK_ENTRIES; head = head->next) {
+            members[count++] = head;
+        }
+        slot = blockAt(&fresh, id);
+        if (!slot || encodeBlock(id, members, count, &body) != 0 ||
+            writeBlockRecord(&writer, &fresh, slot, &body) != 0) {
+            printf("Failed to compress data\n");
+            result = -1;
+        }
+        if (slot) slot->entries = (int)count;
+        id++;
+    }
+    free(body.data);
+    free(writer.chunk);
+    if (fclose(writer.file) != 0) result = -1;
+
+    if (result == 0 && rename(tempName, filename) != 0) {
+        perror("rename");
+        result = -1;
     }
+    if (result != 0) remove(tempName);
+    free(tempName);
+
+    /* Offsets in fresh only hold for the file that was swapped in */
+    if (result == 0 && table) {
+        free(table->blocks);
+        *table = fresh;
+    } else {
+        free(fresh.blocks);
+    }
+    return result;
+}
+
+/* Save all entries to encrypted file, rewriting it from scratch */
+int saveAllEntries(const DiaryEntry* head, const char* filename, const char* key) {
+    return writeDiaryFile(head, filename, key, NULL);
+}
+
+/* Save what changed since the diary was loaded or last saved: new entries
+ * join the last block, and only blocks with a new, changed or deleted
+ * entry are encoded and written again. Anything the table cannot account
+ * for, or a file more than half made of freed records, is rewritten whole */
+int saveDiaryChanges(DiaryEntry* head, DiaryBlockTable* table, const char* filename,
+                     const char* key) {
+    EncryptWriter writer;
+    MemoryWriter body = {0};
+    DiaryEntry* cur;
+    const DiaryEntry** members = NULL;
+    int* present = NULL;
+    int* start = NULL;
+    int* fill = NULL;
+    char* dirty = NULL;
+    int fresh = 0, blocks, last, id, i;
+    size_t total = 0;
+    int result = 0;
+
+    writer.file = NULL;
+    if (!table->loose && table->count > 0 && table->freed <= table->count) {
+        writer.file = openDiaryLog(filename, key, "r+b");
+    }
+    if (!writer.file) {
+        /* Whole rewrite: blocks follow list order */
+        if (writeDiaryFile(head, filename, key, table) != 0) return -1;
+        for (i = 0, cur = head; cur; cur = cur->next, i++) {
+            cur->block = i / DIARY_BLOCK_ENTRIES;
+            cur->dirty = 0;
+        }
+        return 0;
+    }
+
+    /* Step 1: count what each block holds now, and the new entries */
+    for (cur = head; cur; cur = cur->next) {
+        if (cur->block < 0 || cur->block >= table->count) {
+            cur->block = -1;
+            fresh++;
+        }
+    }
+    blocks = table->count + fresh / DIARY_BLOCK_ENTRIES + 1;
+    present = calloc((size_t)blocks, sizeof(*present));
+    start = calloc((size_t)blocks + 1, sizeof(*start));
+    fill = calloc((size_t)blocks, sizeof(*fill));
+    dirty = calloc((size_t)blocks, 1);
+    writer.key = key;
+    writer.chunk = malloc(SAVE_CHUNK_SIZE);
+    if (!present || !start || !fill || !dirty || !writer.chunk) {
+        result = -1;
+    }
+    for (cur = head; result == 0 && cur; cur = cur->next) {
+        if (cur->block >= 0) {
+            present[cur->block]++;
+            if (cur->dirty) dirty[cur->block] = 1;
+        }
+    }
+
+    /* Step 2: place new entries in the last block, then in new ones */
+    last = table->count - 1;
+    for (cur = head; result == 0 && cur; cur = cur->next) {
+        if (cur->block >= 0) continue;
+        if (present[last] >= DIARY_BLOCK_ENTRIES) {
+            last++;
+            if (!blockAt(table, last)) { result = -1; break; }
+        }
+        cur->block = last;
+        present[last]++;
+        dirty[last] = 1;
+    }
+
+    /* Step 3: a block that lost an entry is dirty too; gather the members
+     * of dirty blocks only */
+    for (id = 0; result == 0 && id < table->count; id++) {
+        if (present[id] != table->blocks[id].entries) dirty[id] = 1;
+        start[id + 1] = start[id] + (dirty[id] ? present[id] : 0);
+    }
+    total = result == 0 ? (size_t)start[table->count] : 0;
+    if (total > 0) {
+        members = malloc(total * sizeof(*members));
+        if (!members) result = -1;
+    }
+    for (cur = head; result == 0 && cur; cur = cur->next) {
+        if (dirty[cur->block]) {
+            members[start[cur->block] + fill[cur->block]++] = cur;
+        }
+    }
+
+    /* Step 4: encode each dirty block and append its new copy */
+    for (id = 0; result == 0 && id < table->count; id++) {
+        if (!dirty[id]) continue;
+        if (encodeBlock(id, members ? members + start[id] : NULL, (size_t)present[id], &body) != 0 ||
+            writeBlockRecord(&writer, table, &table->blocks[id], &body) != 0) {
+            printf("Failed to save diary changes\n");
+            result = -1;
+            break;
+        }
+        table->blocks[id].entries = present[id];
+    }
+    if (fclose(writer.file) != 0) result = -1;
+
+    /* After a failure the table may not match the file; the next save
+     * rewrites it whole */
+    if (result == 0) {
+        for (cur = head; cur; cur = cur->next) cur->dirty = 0;
+    } else {
+        table->loose = 1;
+    }
+    free(members);
+    free(present);
+    free(start);
+    free(fill);
+    free(dirty);
+    free(body.data);
+    free(writer.chunk);
+    return result;
+}
+
+void freeBlockTable(DiaryBlockTable* table) {
+    if (table) {
+        free(table->blocks);
+        memset(table, 0, sizeof(*table));
+    }
+}
+
+/* diary.enc mapped privately and writable, so ciphertext can be turned
+ * into plaintext where it lies. Windows already decoded are unmapped as
+ * loading moves on, which keeps the private copies to about one window */
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t released;         /* bytes from the start already unmapped */
+} MappedFile;
+
+/* One open and fstat; the descriptor is not needed once mapped */
+static int mapFile(const char* filename, MappedFile* map) {
+    struct stat st;
+    void* data;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 ||
+        (unsigned long long)st.st_size > (size_t)-1) {
+        close(fd);
+        return -1;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+
+    posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+    map->data = data;
+    map->size = (size_t)st.st_size;
+    map->released = 0;
+    return 0;
+}
+
+/* Unmap the whole windows that lie before upTo */
+static void releaseMapped(MappedFile* map, size_t upTo) {
+    size_t end = upTo - upTo % LOAD_WINDOW_SIZE;
+
+    if (end > map->released) {
+        munmap(map->data + map->released, end - map->released);
+        map->released = end;
+    }
+}
+
+static void unmapFile(MappedFile* map) {
+    if (map->size > map->released) {
+        munmap(map->data + map->released, map->size - map->released);
+    }
+    map->released = map->size;
+}
+
+/* Decrypt len bytes at offset into out without touching the mapping */
+static void copyDecrypted(const MappedFile* map, size_t offset, size_t len,
+                          const char* key, void* out) {
+    memcpy(out, map->data + offset, len);
+    xorDecryptAt(out, len, key, offset);
+}
+
+/* Feed limit bytes of the mapping from offset on through the decompressor
+ * into the parser, decrypting a window at a time in place. Whole frames
+ * are decoded straight from the mapping, and entries are parsed as each
+ * block comes out */
+static int streamEntries(MappedFile* map, const char* key, size_t offset, size_t limit,
+                         EntryParser* parser) {
+    struct decompress_stream stream;
+    size_t take;
+    int result;
+
+    if (decompress_stream_init(&stream, NULL, parseSink, parser) != 0) return -1;
+
+    result = 0;
+    while (result == 0 && limit > 0) {
+        take = LOAD_WINDOW_SIZE - offset % LOAD_WINDOW_SIZE;
+        if (take > limit) take = limit;
+        xorDecryptAt((char*)map->data + offset, take, key, offset);
+        result = decompress_stream_write(&stream, map->data + offset, take);
+        offset += take;
+        limit -= take;
+        releaseMapped(map, offset);
+    }
+    if (result == 0) {
+        result = decompress_stream_finish(&stream);
+    }
+    decompress_stream_free(&stream);
+
+    /* An entry left without its end marker is still read */
+    if (result == 0 && parser->tailLen > 0) {
+        parseEntries(parser->tail, parser->tail + parser->tailLen, &parser->head);
+    }
+    parser->tailLen = 0;
+    return result;
+}
+
+/* Replay the records of a log: each block record adds its entries, and
+ * free records are only counted. Where each block lies goes into table.
+ * A record cut short at the end of the file is left out */
+static int replayDiaryLog(MappedFile* map, const char* key, EntryParser* parser,
+                          DiaryBlockTable* table) {
+    unsigned char record[DIARY_RECORD_HEADER_SIZE];
+    unsigned char prefix[DIARY_BLOCK_PREFIX_SIZE];
+    size_t offset = DIARY_HEADER_SIZE;
+    unsigned long long length;
+    unsigned long long used;
+    unsigned long id;
+    DiaryEntry* before;
+    DiaryEntry* cur;
+    DiaryBlock* slot;
+    int count, i;
+
+    while (offset + DIARY_RECORD_HEADER_SIZE <= map->size) {
+        copyDecrypted(map, offset, sizeof(record), key, record);
+        offset += DIARY_RECORD_HEADER_SIZE;
+        length = getRecordLength(record);
+        if (length > map->size - offset) {
+            printf("WARNING: Ignoring an incomplete record at the end of the diary\n");
+            return 0;
+        }
+
+        if (record[0] == DIARY_RECORD_BLOCK && length >= DIARY_BLOCK_PREFIX_SIZE) {
+            copyDecrypted(map, offset, sizeof(prefix), key, prefix);
+            for (id = 0, i = 3; i >= 0; i--) id = (id << 8) | prefix[i];
+            for (used = 0, i = 11; i >= 4; i--) used = (used << 8) | prefix[i];
+            if (used > length - DIARY_BLOCK_PREFIX_SIZE ||
+                id > map->size / (DIARY_RECORD_HEADER_SIZE + DIARY_BLOCK_PREFIX_SIZE)) {
+                return -1;
+            }
+            
+            /* A save cut short between appending a block and freeing its
+             * old copy leaves both; the later copy replaces the earlier */
+            slot = blockAt(table, (int)id);
+            if (!slot) return -1;
+            if (slot->offset >= 0) {
+                dropBlockEntries(&parser->head, (int)id);
+                table->loose = 1;
+            }
+
+            /* the block's entries are the ones parsed in front of the old head */
+            before = parser->head;
+            if (streamEntries(map, key, offset + DIARY_BLOCK_PREFIX_SIZE, (size_t)used, parser) != 0) {
+                return -1;
+            }
+            for (count = 0, cur = parser->head; cur != before; cur = cur->next, count++) {
+                cur->block = (int)id;
+                cur->dirty = 0;
+            }
+            slot->offset = (long)(offset - DIARY_RECORD_HEADER_SIZE);
+            slot->entries = count;
+        }
+        else if (record[0] == DIARY_RECORD_FREE) {
+            table->freed++;
+        }
+        offset += (size_t)length;
+        releaseMapped(map, offset);
+    }
+    return 0;
+}
+
+/* A diary saved before the compressed container existed: the whole file
+ * is XORed from offset 0 and decoded in one piece */
+static int loadLegacyBuffer(MappedFile* map, const char* key, EntryParser* parser) {
+    char* text;
+    size_t size;
+
+    xorDecryptAt((char*)map->data, map->size, key, 0);
+    text = decompress_legacy((const char*)map->data, map->size, &size);
+    if (!text) return -1;
+    parser->total = size;
+    parseEntries(text, text + size, &parser->head);
+    free(text);
+    if (!parser->head) {
+        printf("ERROR: No valid entry markers found in data\n");
+    }
+    return 0;
+}
+
+/* Load all entries from encrypted file into *head, and where its blocks
+ * lie into table for saveDiaryChanges; an empty diary loads as an empty
+ * list */
+int loadDiaryTable(const char* filename, const char* key, DiaryEntry** head,
+                   DiaryBlockTable* table) {
+    unsigned char header[DIARY_HEADER_SIZE];
+    size_t offset = DIARY_HEADER_SIZE;
+    MappedFile map;
+    EntryParser parser = {0};
+    DiaryBlockTable scratch = {0};
+    int result;
+    int isLog = 0;
+    
+    *head = NULL;
+    if (!table) table = &scratch;
+    table->count = 0;
+    table->loose = 0;
+    table->freed = 0;
     
     /* Check key */
     if (!key || strlen(key) < 4) {
         printf("ERROR: Invalid encryption key\n");
-        free(encrypted);
-        return NULL;
+        return -1;
     }
     
-    /* Decrypt */
-    decrypted = malloc(fileSize);
-    if (!decrypted) {
-        printf("ERROR: Failed to allocate memory for decryption\n");
-        free(encrypted);
-        return NULL;
+    /* One open and fstat serve for the size, the key check and the payload */
+    if (mapFile(filename, &map) != 0) {
+        printf("Failed to open file\n");
+        return -1;
     }
-    memcpy(decrypted, encrypted, fileSize);
-    xorDecrypt(decrypted, fileSize, key);
-    free(encrypted);
     
-    /* Decompress */
-    decompressed = decompress(decrypted, fileSize);
-    free(decrypted);
+    printf("Loading diary file (%lu bytes)...\n", (unsigned long)map.size);
     
-    if (!decompressed) {
-        printf("ERROR: Failed to decompress (wrong key?)\n");
-        return NULL;
+    /* Reject a wrong key from the header alone; files from before the
+     * header existed are read whole as they are */
+    memcpy(header, map.data, map.size < sizeof(header) ? map.size : sizeof(header));
+    switch (verifyDiaryHeader(header, map.size, key)) {
+    case 0:
+        printf("ERROR: Wrong password\n");
+        unmapFile(&map);
+        return -1;
+    case -1:
+        offset = 0;
+        break;
+    default:
+        isLog = header[4] == DIARY_HEADER_VERSION;
+        break;
     }
     
-    size_t decompressedSize = strlen(decompressed);
+    /* A log is replayed record by record; an older file is one container,
+     * or from before the container existed, one old format buffer */
+    copyDecrypted(&map, 0, map.size < LEGACY_PREFIX_SIZE ? map.size : LEGACY_PREFIX_SIZE,
+                  key, header);
+    if (isLog) {
+        result = replayDiaryLog(&map, key, &parser, table);
+    } else if (offset == 0 && is_legacy_compressed(header, map.size)) {
+        result = loadLegacyBuffer(&map, key, &parser);
+        table->loose = 1;
+    } else {
+        result = streamEntries(&map, key, offset, map.size - offset, &parser);
+        if (result == 0 && parser.total > 0 && !parser.head) {
+            printf("ERROR: No valid entry markers found in data\n");
+        }
+        table->loose = 1;
+    }
+    free(parser.tail);
+    free(scratch.blocks);
+    unmapFile(&map);
     
-    if (decompressedSize == 0) {
-        printf("WARNING: Empty data after decompression\n");
-        free(decompressed);
-        return NULL;
+    if (result != 0) {
+        printf("ERROR: Failed to decompress (wrong key?)\n");
+        freeAllEntries(parser.head);
+        table->count = 0;
+        return -1;
     }
     
-    /* Parse entries */
-    entries = deserializeEntries(decompressed, decompressedSize);
-    free(decompressed);
+    *head = parser.head;
+    return 0;
+}
+
+int loadDiary(const char* filename, const char* key, DiaryEntry** head) {
+    return loadDiaryTable(filename, key, head, NULL);
+}
+
+/* Load all entries from encrypted file */
+DiaryEntry* loadAllEntries(const char* filename, const char* key) {
+    DiaryEntry* head;
     
-    return entries;
+    if (loadDiary(filename, key, &head) != 0) {
+        return NULL;
+    }
+    return head;
 }
 
 /* Search for entries containing search term */
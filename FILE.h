@@ -1,12 +1,16 @@
 #ifndef FILE_H
 #define FILE_H
 
+#include "encryption.h"
+
 
 
 typedef struct DiaryEntry {
     char *datetime,              /* e.g., "YYYY-MM-DD" */
          *content;           /* entry text - one line 4 simple format */
     int wordCount;           /* cached word count */
+    int block;               /* block it is saved in, -1 if not saved yet */
+    int dirty;               /* changed since it was last saved */
     struct DiaryEntry *next; /* singly-linked list */
 } DiaryEntry;
 
@@ -27,9 +31,55 @@ void addEntry(DiaryEntry **head, DiaryEntry *newEntry);
 
 void delEntry(DiaryEntry **head, const char *datetime);
 
+/* diary.enc starts with a key check header so a wrong password is turned
+ * away before the bulk of the file is read. After it comes a log of
+ * records, each a type byte, a u64 body length and the body, encrypted by
+ * file offset: a block record holds up to DIARY_BLOCK_ENTRIES compressed
+ * entries, and a free record a block copy that was replaced. A save
+ * appends a new copy of each block whose entries changed and then marks
+ * the old copy free */
+#define DIARY_MAGIC            "DIRY"
+#define DIARY_HEADER_VERSION   2
+#define DIARY_SNAPSHOT_VERSION 1     /* older files: one container, no records */
+#define DIARY_HEADER_SIZE      (5 + KEY_SALT_SIZE + KEY_CHECK_SIZE)
+#define DIARY_RECORD_HEADER_SIZE 9
+#define DIARY_BLOCK_ENTRIES    64
+#define DIARY_BLOCK_PREFIX_SIZE 12   /* block id (u32), container length (u64) */
+
+enum diaryRecord {
+    DIARY_RECORD_BLOCK   = 3,
+    DIARY_RECORD_FREE    = 4
+};
+
+/* Where each block of a loaded diary lies, for saving only what changed */
+typedef struct {
+    long offset;                   /* record start, -1 if not written yet */
+    int entries;                   /* entries in it when last written */
+} DiaryBlock;
+
+typedef struct {
+    DiaryBlock* blocks;
+    int count;
+    int capacity;
+    int loose;                     /* file not laid out in these blocks; rewrite whole */
+    int freed;                     /* free records left by moved blocks */
+} DiaryBlockTable;
+
+int checkDiaryKey(const char* filename, const char* key);   /* 1 right key, 0 wrong key, -1 nothing to check */
+
 // UPDATED: Now includes key parameter
 int saveAllEntries(const DiaryEntry* head, const char* filename, const char* key);
 
+int saveDiaryChanges(DiaryEntry* head, DiaryBlockTable* table, const char* filename,
+                     const char* key);   /* re-encodes only dirty blocks */
+
+void freeBlockTable(DiaryBlockTable* table);
+
+int loadDiary(const char* filename, const char* key, DiaryEntry** head);   /* 0 even when the diary is empty */
+
+int loadDiaryTable(const char* filename, const char* key, DiaryEntry** head,
+                   DiaryBlockTable* table);
+
 DiaryEntry* loadAllEntries(const char* filename, const char* key);
 
 void freeAllEntries(DiaryEntry *head);
@@ -15,6 +15,7 @@ ID: 26130916
 static DiaryEntry* diary_head = NULL;
 static char current_filename[256] = "diary.enc";
 static char encryption_key[256] = "";
+static DiaryBlockTable diary_blocks = {0};
 
 /* Display main menu */
 void displaymenue(void){
@@ -147,17 +148,10 @@ void diaryDisplayAllEntries(DiaryEntry* head){
     printf("========================================\n");
 }
 
-/* Save diary to encrypted file */
-int diarySaveEncrypted(DiaryEntry* head, const char* filename, const char* key){
-    if (!head) {
-        printf("No entries to save. Create an entry first.\n");
-        return 0;
-    }
-    
+/* Save only the blocks touched since the diary was loaded or saved */
+static int diarySaveChanges(DiaryEntry* head, const char* filename, const char* key){
     printf("\nSaving encrypted diary to '%s'\n", filename);
-    
-    int result = saveAllEntries(head, filename, key);
-    return (result == 0) ? 1 : 0;
+    return saveDiaryChanges(head, &diary_blocks, filename, key) == 0;
 }
 
 /* Load diary from encrypted file */
@@ -173,9 +167,7 @@ int diaryLoadEncrypted(DiaryEntry** head, const char* filename, const char* key)
         *head = NULL;
     }
     
-    *head = loadAllEntries(filename, key);
-    
-    if (*head) {
+    if (loadDiaryTable(filename, key, head, &diary_blocks) == 0) {
         int count = 0;
         DiaryEntry* current = *head;
         while (current) {
@@ -372,8 +364,23 @@ int diaryMenuLoop(void){
 
     /* Step 2: Auto-load if diary exists */
     if (diaryExists) {
-        printf("\nExisting diary found. Loading...\n");
-        int loadSuccess = diaryLoadEncrypted(&diary_head, current_filename, encryption_key);
+        /* The file header says at once whether the key is right, so ask
+         * again before loading anything */
+        int keyCheck = checkDiaryKey(current_filename, encryption_key);
+        int wrongAttempts = 0;
+        while (keyCheck == 0 && wrongAttempts < maxAttempts - 1) {
+            printf("\nWrong password for this diary. Please try again.\n");
+            wrongAttempts++;
+            if (setEncryptionKey(encryption_key, sizeof(encryption_key))) {
+                keyCheck = checkDiaryKey(current_filename, encryption_key);
+            }
+        }
+
+        int loadSuccess = 0;
+        if (keyCheck != 0) {
+            printf("\nExisting diary found. Loading...\n");
+            loadSuccess = diaryLoadEncrypted(&diary_head, current_filename, encryption_key);
+        }
         
         if (!loadSuccess) {
             printf("\n╔════════════════════════════════════════╗\n");
@@ -426,7 +433,7 @@ int diaryMenuLoop(void){
         switch (choice) {
             case 1:
                 if (diaryCreateEntry(&diary_head)) {
-                    diarySaveEncrypted(diary_head, current_filename, encryption_key);
+                    diarySaveChanges(diary_head, current_filename, encryption_key);
                 }
                 break;
                 
@@ -440,7 +447,7 @@ int diaryMenuLoop(void){
 
             case 4:
                 if (diaryDeleteEntry(&diary_head)) {
-                   diarySaveEncrypted(diary_head, current_filename, encryption_key);
+                   diarySaveChanges(diary_head, current_filename, encryption_key);
                 }
                 break;
                 
@@ -449,15 +456,17 @@ int diaryMenuLoop(void){
                 printf("  Exiting Secure Diary System\n");
                 printf("========================================\n");
                 
+                /* Every change was saved as it was made; this only
+                 * catches blocks a failed save left dirty */
                 if (diary_head && strlen(encryption_key) > 0) {
-                    printf("Auto-saving diary entries before exit...\n");
-                    diarySaveEncrypted(diary_head, current_filename, encryption_key);
+                    diarySaveChanges(diary_head, current_filename, encryption_key);
                 }
                 
                 if (diary_head) {
                     freeAllEntries(diary_head);
                     diary_head = NULL;
                 }
+                freeBlockTable(&diary_blocks);
                 
                 printf("Goodbye!\n");
                 running = 0;
@@ -22,7 +22,6 @@ int diaryMenuLoop(void);
 // Entry management functions
 int diaryCreateEntry(DiaryEntry** head);
 void diaryDisplayAllEntries(DiaryEntry* head);
-int diarySaveEncrypted(DiaryEntry* head, const char* filename, const char* key);
 int diaryLoadEncrypted(DiaryEntry** head, const char* filename, const char* key);
 int diaryDeleteEntry(DiaryEntry** head);
 int diarySearchEntries(DiaryEntry* head);
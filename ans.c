@@ -0,0 +1,445 @@
+/*
+ * tANS entropy coder for the block codec. Each payload carries its own
+ * normalised symbol counts; both sides spread them over the state table
+ * the same way, the encoder builds per-symbol transforms from it and the
+ * decoder a table of (symbol, bits to read, next state base).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "ans.h"
+
+#define NUM_SYMBOLS 256u
+#define MIN_TABLE_LOG 5
+/* Symbols alternate between two states so decoding runs two chains at once */
+#define ANS_STATES 2
+
+struct ans_decode_entry {
+    uint16_t new_state;
+    unsigned char symbol;
+    unsigned char bits;
+};
+
+/* Encoder transform for one symbol, as in FSE: the bits to emit for state
+ * x are (x + delta_bits) >> 16, and the next state comes from the state
+ * table at (x >> bits) + delta_state */
+struct ans_symbol_transform {
+    int32_t delta_state;
+    uint32_t delta_bits;
+};
+
+static unsigned int highest_bit(uint32_t v) {
+    unsigned int n = 0;
+
+    while (v >>= 1) {
+        n++;
+    }
+    return n;
+}
+
+/* Smallest table that still gives every coded symbol a state and is not
+ * much bigger than the input */
+static unsigned int choose_table_log(size_t len, unsigned int symbols) {
+    unsigned int log = ANS_TABLE_LOG;
+    unsigned int min_log = highest_bit(symbols - 1) + 2;
+
+    while (log > MIN_TABLE_LOG && ((size_t)1 << (log - 1)) >= len) {
+        log--;
+    }
+    if (log < min_log) {
+        log = min_log;
+    }
+    return log;
+}
+
+/* Scales counts to sum to 1 << table_log, every present symbol keeping at least 1 */
+static void normalise_counts(const size_t *counts, size_t total, unsigned int table_log,
+                             uint32_t *norm) {
+    uint32_t table_size = 1U << table_log;
+    uint32_t sum = 0;
+    unsigned int s, largest = 0;
+
+    for (s = 0; s < NUM_SYMBOLS; s++) {
+        norm[s] = 0;
+        if (counts[s] == 0) {
+            continue;
+        }
+        norm[s] = (uint32_t)(((uint64_t)counts[s] * table_size + total / 2) / total);
+        if (norm[s] == 0) {
+            norm[s] = 1;
+        }
+        sum += norm[s];
+        if (norm[s] > norm[largest]) {
+            largest = s;
+        }
+    }
+    /* the rounding error normally fits on the most probable symbol */
+    if (sum < table_size || norm[largest] > sum - table_size) {
+        norm[largest] += table_size;
+        norm[largest] -= sum;
+        return;
+    }
+    while (sum > table_size) {
+        unsigned int pick = 0;
+        for (s = 0; s < NUM_SYMBOLS; s++) {
+            if (norm[s] > norm[pick]) {
+                pick = s;
+            }
+        }
+        norm[pick]--;
+        sum--;
+    }
+}
+
+/* Deals the states out to the symbols, norm[s] each, stepping through
+ * the table so every symbol's states are spread across it */
+static void spread_symbols(const uint32_t *norm, unsigned int table_log, unsigned char *spread) {
+    uint32_t table_size = 1U << table_log;
+    uint32_t mask = table_size - 1;
+    uint32_t step = (table_size >> 1) + (table_size >> 3) + 3;
+    uint32_t pos = 0;
+    unsigned int s;
+    uint32_t i;
+
+    for (s = 0; s < NUM_SYMBOLS; s++) {
+        for (i = 0; i < norm[s]; i++) {
+            spread[pos] = (unsigned char)s;
+            pos = (pos + step) & mask;
+        }
+    }
+}
+
+static int build_decode_entries(const uint32_t *norm, unsigned int table_log,
+                                struct ans_decode_entry *table) {
+    unsigned char spread[1U << ANS_MAX_TABLE_LOG];
+    uint32_t next[NUM_SYMBOLS];
+    uint32_t table_size = 1U << table_log;
+    uint32_t u;
+
+    spread_symbols(norm, table_log, spread);
+    memcpy(next, norm, sizeof(next));
+    for (u = 0; u < table_size; u++) {
+        unsigned char s = spread[u];
+        uint32_t x = next[s]++;
+        unsigned int bits = table_log - highest_bit(x);
+
+        table[u].symbol = s;
+        table[u].bits = (unsigned char)bits;
+        table[u].new_state = (uint16_t)((x << bits) - table_size);
+    }
+    return 0;
+}
+
+static void build_encode_tables(const uint32_t *norm, unsigned int table_log, uint16_t *state_table,
+                                struct ans_symbol_transform *transform) {
+    unsigned char spread[1U << ANS_MAX_TABLE_LOG];
+    uint32_t cumul[NUM_SYMBOLS + 1];
+    uint32_t table_size = 1U << table_log;
+    uint32_t total = 0;
+    unsigned int s;
+    uint32_t u;
+
+    spread_symbols(norm, table_log, spread);
+    cumul[0] = 0;
+    for (s = 0; s < NUM_SYMBOLS; s++) {
+        cumul[s + 1] = cumul[s] + norm[s];
+    }
+    for (u = 0; u < table_size; u++) {
+        state_table[cumul[spread[u]]++] = (uint16_t)(table_size + u);
+    }
+    for (s = 0; s < NUM_SYMBOLS; s++) {
+        if (norm[s] == 0) {
+            continue;
+        }
+        if (norm[s] == 1) {
+            transform[s].delta_bits = (table_log << 16) - table_size;
+            transform[s].delta_state = (int32_t)total - 1;
+        } else {
+            unsigned int max_bits = table_log - highest_bit(norm[s] - 1);
+            uint32_t min_state_plus = norm[s] << max_bits;
+            transform[s].delta_bits = (max_bits << 16) - min_state_plus;
+            transform[s].delta_state = (int32_t)total - (int32_t)norm[s];
+        }
+        total += norm[s];
+    }
+}
+
+static size_t put_varint(unsigned char *out, uint32_t value) {
+    size_t n = 0;
+
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+static int get_varint(const unsigned char *in, size_t size, size_t *pos, uint32_t *value) {
+    uint32_t v = 0;
+    unsigned int shift = 0;
+
+    while (*pos < size && shift < 21) {
+        unsigned char b = in[(*pos)++];
+        v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+/* Normalised count header; returns its size */
+static size_t write_counts(const uint32_t *norm, unsigned int table_log, unsigned int symbols,
+                           unsigned char *out) {
+    size_t pos = 2;
+    unsigned int s;
+
+    out[0] = (unsigned char)table_log;
+    out[1] = (unsigned char)(symbols - 1);
+    /* pairs cost 2-3 bytes a symbol, the dense form 1-2 bytes for all 256 */
+    if (3 * symbols < NUM_SYMBOLS) {
+        for (s = 0; s < NUM_SYMBOLS; s++) {
+            if (norm[s] > 0) {
+                out[pos++] = (unsigned char)s;
+                pos += put_varint(out + pos, norm[s]);
+            }
+        }
+        return pos;
+    }
+    for (s = 0; s < NUM_SYMBOLS; s++) {
+        pos += put_varint(out + pos, norm[s]);
+    }
+    return pos;
+}
+
+static long read_counts(const unsigned char *in, size_t size, uint32_t *norm, unsigned int *table_log) {
+    unsigned int symbols, s;
+    uint32_t sum = 0;
+    size_t pos = 2;
+
+    if (size < 2) {
+        return -1;
+    }
+    *table_log = in[0];
+    symbols = in[1] + 1U;
+    if (*table_log < MIN_TABLE_LOG || *table_log > ANS_MAX_TABLE_LOG) {
+        return -1;
+    }
+    memset(norm, 0, NUM_SYMBOLS * sizeof(*norm));
+    if (3 * symbols < NUM_SYMBOLS) {
+        for (s = 0; s < symbols; s++) {
+            unsigned char symbol;
+            if (pos >= size) {
+                return -1;
+            }
+            symbol = in[pos++];
+            if (norm[symbol] != 0 || get_varint(in, size, &pos, &norm[symbol]) != 0 ||
+                norm[symbol] == 0) {
+                return -1;
+            }
+            sum += norm[symbol];
+        }
+    } else {
+        for (s = 0; s < NUM_SYMBOLS; s++) {
+            if (get_varint(in, size, &pos, &norm[s]) != 0 || norm[s] > (1U << *table_log)) {
+                return -1;
+            }
+            sum += norm[s];
+        }
+    }
+    if (sum != 1U << *table_log) {
+        return -1;
+    }
+    return (long)pos;
+}
+
+
+/******  *Function  : unsigned char *ans_encode(const unsigned char *in, size_t len, size_t *out_size)
+ *Description : tANS codes len bytes
+ *Parameters : in, len - data, len at least 1
+ *              out_size - receives the payload size
+ *Effects : symbols are coded from the last to the first, bits go out least
+ *          significant first and the final state is written last
+ *Returned : malloc'd payload, or NULL on failure
+ */
+
+unsigned char *ans_encode(const unsigned char *in, size_t len, size_t *out_size) {
+    size_t counts[NUM_SYMBOLS] = {0};
+    uint32_t norm[NUM_SYMBOLS];
+    uint16_t state_table[1U << ANS_MAX_TABLE_LOG];
+    struct ans_symbol_transform transform[NUM_SYMBOLS];
+    unsigned int symbols = 0, table_log, s;
+    unsigned char *out, *bits;
+    size_t header_size, pos = 0, i;
+    uint64_t acc = 0, bit_count = 0;
+    unsigned int acc_bits = 0;
+    uint32_t state[ANS_STATES];
+
+    if (!in || len == 0 || len > UINT32_MAX / ANS_MAX_TABLE_LOG) {
+        return NULL;
+    }
+    for (i = 0; i < len; i++) {
+        counts[in[i]]++;
+    }
+    for (s = 0; s < NUM_SYMBOLS; s++) {
+        symbols += counts[s] > 0;
+    }
+    table_log = choose_table_log(len, symbols);
+    normalise_counts(counts, len, table_log, norm);
+    build_encode_tables(norm, table_log, state_table, transform);
+
+    /* no symbol costs more than table_log bits */
+    out = malloc(ANS_HEADER_MAX_SIZE + (len + ANS_STATES) * table_log / 8 + 8);
+    if (!out) {
+        return NULL;
+    }
+    header_size = write_counts(norm, table_log, symbols, out);
+    bits = out + header_size + 4;
+
+    for (s = 0; s < ANS_STATES; s++) {
+        state[s] = 1U << table_log;
+    }
+    for (i = len; i-- > 0;) {
+        const struct ans_symbol_transform *t = &transform[in[i]];
+        uint32_t *x = &state[i % ANS_STATES];
+        unsigned int n = (*x + t->delta_bits) >> 16;
+
+        acc |= (uint64_t)(*x & ((1U << n) - 1)) << acc_bits;
+        acc_bits += n;
+        *x = state_table[(*x >> n) + t->delta_state];
+        while (acc_bits >= 8) {
+            bits[pos++] = (unsigned char)acc;
+            acc >>= 8;
+            acc_bits -= 8;
+        }
+        bit_count += n;
+    }
+    for (s = 0; s < ANS_STATES; s++) {
+        acc |= (uint64_t)(state[s] - (1U << table_log)) << acc_bits;
+        acc_bits += table_log;
+        bit_count += table_log;
+        while (acc_bits >= 8) {
+            bits[pos++] = (unsigned char)acc;
+            acc >>= 8;
+            acc_bits -= 8;
+        }
+    }
+    while (acc_bits > 0) {
+        bits[pos++] = (unsigned char)acc;
+        acc >>= 8;
+        acc_bits = acc_bits > 8 ? acc_bits - 8 : 0;
+    }
+    out[header_size] = (unsigned char)bit_count;
+    out[header_size + 1] = (unsigned char)(bit_count >> 8);
+    out[header_size + 2] = (unsigned char)(bit_count >> 16);
+    out[header_size + 3] = (unsigned char)(bit_count >> 24);
+    *out_size = header_size + 4 + pos;
+    return out;
+}
+
+
+/* Reads the bitstream from its end back to its start. window holds the 8
+ * bytes from byte base up, so every bit from base * 8 to pos is at hand */
+struct back_reader {
+    const unsigned char *bits;
+    size_t size;
+    size_t base;
+    uint64_t window;
+    uint64_t pos;
+};
+
+static void back_load(struct back_reader *br) {
+    size_t i;
+
+    br->base = br->pos > 64 ? (size_t)((br->pos - 57) / 8) : 0;
+    br->window = 0;
+    for (i = 0; i < 8 && br->base + i < br->size; i++) {
+        br->window |= (uint64_t)br->bits[br->base + i] << (8 * i);
+    }
+}
+
+static void back_init(struct back_reader *br, const unsigned char *bits, size_t size, uint64_t pos) {
+    br->bits = bits;
+    br->size = size;
+    br->pos = pos;
+    back_load(br);
+}
+
+/* The n bits just below the read position, n at most ANS_MAX_TABLE_LOG
+ * and never more than are left */
+static uint32_t back_read(struct back_reader *br, unsigned int n) {
+    uint64_t shift;
+
+    if (br->pos - (uint64_t)br->base * 8 < n) {
+        back_load(br);
+    }
+    br->pos -= n;
+    shift = br->pos - (uint64_t)br->base * 8;
+    return (uint32_t)(br->window >> shift) & ((1U << n) - 1);
+}
+
+
+/******  *Function  : int ans_decode(const unsigned char *in, size_t size, unsigned char *out, size_t out_len)
+ *Description : decodes a payload written by ans_encode
+ *Parameters : in, size - payload
+ *              out - receives exactly out_len bytes
+ *Effects : reads the bitstream backwards from its last bit
+ *Returned : 0 on success, -1 on a corrupt payload
+ */
+
+int ans_decode(const unsigned char *in, size_t size, unsigned char *out, size_t out_len) {
+    struct ans_decode_entry table[1U << ANS_MAX_TABLE_LOG];
+    uint32_t norm[NUM_SYMBOLS];
+    unsigned int table_log;
+    const unsigned char *bits;
+    struct back_reader br;
+    uint64_t bit_count;
+    uint32_t state[ANS_STATES];
+    unsigned int s;
+    size_t i, bytes;
+    long header_size;
+
+    header_size = read_counts(in, size, norm, &table_log);
+    if (header_size < 0 || size - (size_t)header_size < 4) {
+        return -1;
+    }
+    bits = in + header_size + 4;
+    bit_count = (uint64_t)in[header_size] | ((uint64_t)in[header_size + 1] << 8) |
+                ((uint64_t)in[header_size + 2] << 16) | ((uint64_t)in[header_size + 3] << 24);
+    bytes = (size_t)((bit_count + 7) / 8);
+    if (bytes > size - (size_t)header_size - 4 || bit_count < ANS_STATES * table_log) {
+        return -1;
+    }
+    build_decode_entries(norm, table_log, table);
+
+    back_init(&br, bits, bytes, bit_count);
+    for (s = ANS_STATES; s-- > 0;) {
+        state[s] = back_read(&br, table_log);
+    }
+    for (i = 0; i + 1 < out_len; i += 2) {
+        const struct ans_decode_entry *e0 = &table[state[0]];
+        const struct ans_decode_entry *e1 = &table[state[1]];
+
+        if ((uint64_t)e0->bits + e1->bits > br.pos) {
+            return -1;
+        }
+        out[i] = e0->symbol;
+        out[i + 1] = e1->symbol;
+        state[0] = e0->new_state + back_read(&br, e0->bits);
+        state[1] = e1->new_state + back_read(&br, e1->bits);
+    }
+    if (i < out_len) {
+        const struct ans_decode_entry *e = &table[state[0]];
+
+        if (e->bits > br.pos) {
+            return -1;
+        }
+        out[i] = e->symbol;
+        back_read(&br, e->bits);
+    }
+    return br.pos == 0 ? 0 : -1;
+}
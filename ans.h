@@ -0,0 +1,21 @@
+#ifndef ANS_H
+#define ANS_H
+
+#include <stddef.h>
+
+/* Table-based ANS (tANS, as in FSE) over bytes. Symbol counts are
+ * normalised to a table of 1 << table log states, so a symbol of
+ * probability p costs close to -log2(p) bits instead of a whole number.
+ * Payload: table log (u8), coded symbols minus one (u8), then either
+ * (symbol, count) pairs or all 256 counts, counts as varints; bit count
+ * (u32); then the bits. Even and odd positions are coded with two
+ * separate states, last symbol first, so the decoder reads both final
+ * states first and then runs forwards on two independent chains. */
+#define ANS_MAX_TABLE_LOG   12
+#define ANS_TABLE_LOG       11
+#define ANS_HEADER_MAX_SIZE (2 + 2 * 256 + 4)
+
+unsigned char *ans_encode(const unsigned char *in, size_t len, size_t *out_size);
+int ans_decode(const unsigned char *in, size_t size, unsigned char *out, size_t out_len);
+
+#endif
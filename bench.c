@@ -0,0 +1,621 @@
+/*
+ * Codec microbenchmarks.
+ *
+ * Usage: ./bench [name] [size_mb]
+ *   decode   - table decoder against the original code table scan
+ *   build    - heap tree builder against the pool scan builder
+ *   limit    - size and decode speed cost of capping code lengths
+ *   threads  - block mode compress/decompress speed by thread count
+ *   histogram - byte-at-a-time counting against the histogram kernels
+ *   lz       - ratio and speed of each LZ77 level, 0 being Huffman alone
+ *   streams  - decode speed of one bitstream against HUFFMAN_STREAMS
+ *   codec    - ratio and speed of Huffman against tANS
+ *   multi    - one symbol per table probe against DECODE_MULTI
+ *   xor      - xorEncrypt() speed with each XOR kernel
+ *
+ * Input is synthetic diary text in the serializeEntries() layout.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "compression.h"
+#include "encryption.h"
+
+static const char *words[] = {
+    "the", "I", "and", "to", "a", "of", "was", "in", "it", "my", "that",
+    "we", "me", "for", "had", "on", "with", "today", "but", "so", "at",
+    "went", "after", "school", "work", "really", "friends", "dinner",
+    "morning", "felt", "tired", "happy", "about", "walk", "coffee",
+    "weekend", "family", "home", "night", "again", "little", "rain",
+    "because", "finally", "tomorrow", "remember", "Sunday", "meeting"
+};
+
+/* Elapsed wall-clock seconds since start */
+static double elapsed(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) +
+           (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Build about size bytes of diary entries; common words come up more often */
+static char *make_diary_text(size_t size) {
+    size_t nwords = sizeof(words) / sizeof(words[0]);
+    char *text = malloc(size + 256);
+    size_t len = 0;
+    int entry = 0;
+
+    if (!text) {
+        return NULL;
+    }
+    srand(42);
+    while (len < size) {
+        int count = 20 + rand() % 60;
+        entry++;
+        len += (size_t)sprintf(text + len, "ENTRY_START\nDATE:2025-%02d-%02d %02d:%02d\nCONTENT:",
+                               entry % 12 + 1, entry % 28 + 1, entry % 24, entry % 60);
+        while (count-- > 0 && len < size) {
+            size_t w = (size_t)(rand() % (int)nwords) % (size_t)(rand() % (int)nwords + 1);
+            len += (size_t)sprintf(text + len, "%s ", words[w]);
+        }
+        len += (size_t)sprintf(text + len, "\nWORDCOUNT:%d\nENTRY_END\n", count);
+    }
+    text[len] = '\0';
+    return text;
+}
+
+static void bench_decode(size_t size) {
+    struct compress_options opts;
+    struct timespec start;
+    char *text = make_diary_text(size);
+    size_t len, compressed_size;
+    char *compressed, *out;
+    double t;
+
+    if (!text) {
+        return;
+    }
+    len = strlen(text);
+    compressed = compress(text, &compressed_size);
+    if (!compressed) {
+        free(text);
+        return;
+    }
+    printf("decode: %zu bytes -> %zu bytes\n", len, compressed_size);
+
+    compress_default_options(&opts);
+    opts.decoder = DECODE_TABLE;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    out = decompress_with_options(compressed, compressed_size, &opts);
+    t = elapsed(&start);
+    printf("  table  %8.3f s  %8.1f MB/s  %s\n", t, len / t / 1e6,
+           out && strcmp(out, text) == 0 ? "ok" : "MISMATCH");
+    free(out);
+
+    opts.decoder = DECODE_SCAN;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    out = decompress_with_options(compressed, compressed_size, &opts);
+    t = elapsed(&start);
+    printf("  scan   %8.3f s  %8.1f MB/s  %s\n", t, len / t / 1e6,
+           out && strcmp(out, text) == 0 ? "ok" : "MISMATCH");
+    free(out);
+
+    free(compressed);
+    free(text);
+}
+
+/* Average seconds per build of ft; the codes from the first build go to ct */
+static double time_builder(struct huffman_tree *(*builder)(const struct frequency_table *),
+                           const struct frequency_table *ft, int iterations, struct code_table *ct) {
+    struct timespec start;
+    struct huffman_tree *root;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iterations; i++) {
+        root = builder(ft);
+        if (i == 0) {
+            generate_encoding(root, ct);
+        }
+        free_huffman_tree(root);
+    }
+    return elapsed(&start) / iterations;
+}
+
+static void bench_build_one(const char *label, const struct frequency_table *ft) {
+    static struct code_table scan_codes, heap_codes;
+    double scan = time_builder(build_tree_from_frequency, ft, 200, &scan_codes);
+    double heap = time_builder(build_tree_from_frequency_heap, ft, 200, &heap_codes);
+    int same = memcmp(scan_codes.length, heap_codes.length, sizeof(scan_codes.length)) == 0;
+
+    printf("  %-14s scan %8.2f us  heap %8.2f us  %5.1fx  %s\n", label,
+           scan * 1e6, heap * 1e6, scan / heap, same ? "same codes" : "CODES DIFFER");
+}
+
+static void bench_build(void) {
+    struct frequency_table ft;
+    unsigned int i;
+    char *text;
+
+    printf("build: per tree\n");
+
+    /* byte-uniform: every byte equally likely */
+    initialise_Frequency(&ft);
+    for (i = 0; i < NUM_SYMBOLS; i++) {
+        ft.freq[i] = 4096;
+    }
+    bench_build_one("byte-uniform", &ft);
+
+    /* skewed: geometric counts over 40 symbols */
+    initialise_Frequency(&ft);
+    for (i = 0; i < 40; i++) {
+        ft.freq['0' + i] = 1ULL << (40 - i);
+    }
+    bench_build_one("skewed", &ft);
+
+    /* full alphabet: diary text plus a sprinkling of every other byte */
+    initialise_Frequency(&ft);
+    text = make_diary_text(1024 * 1024);
+    if (text) {
+        size_t len = strlen(text);
+        for (i = 0; i < len; i++) {
+            ft.freq[(unsigned char)text[i]]++;
+        }
+        free(text);
+    }
+    for (i = 0; i < NUM_SYMBOLS; i++) {
+        ft.freq[i] += 1 + i % 7;
+    }
+    bench_build_one("full-alphabet", &ft);
+}
+
+/* Geometric symbol counts, so an uncapped code gets very deep */
+static char *make_skewed_text(size_t size) {
+    char *text = malloc(size + 1);
+    size_t len = 0;
+    int symbol = 0;
+
+    if (!text) {
+        return NULL;
+    }
+    while (len < size) {
+        size_t run = (size_t)1 << (symbol < 20 ? 20 - symbol : 0);
+        while (run-- > 0 && len < size) {
+            text[len++] = (char)('A' + symbol);
+        }
+        symbol = (symbol + 1) % 40;
+    }
+    text[len] = '\0';
+    return text;
+}
+
+static void bench_limit_one(const char *label, const char *text) {
+    static const unsigned int limits[] = { 0, 15, 12, 11 };
+    struct compress_options opts;
+    struct timespec start;
+    size_t len = strlen(text);
+    size_t base = 0;
+    unsigned int i;
+
+    printf("  %s (%zu bytes)\n", label, len);
+    for (i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+        size_t compressed_size;
+        char *compressed, *out;
+        double t;
+
+        compress_default_options(&opts);
+        opts.max_code_len = limits[i];
+        compressed = compress_with_options(text, &compressed_size, &opts);
+        if (!compressed) {
+            continue;
+        }
+        if (i == 0) {
+            base = compressed_size;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        out = decompress_with_options(compressed, compressed_size, &opts);
+        t = elapsed(&start);
+        printf("    max %2u bits  %9zu bytes  %+6.2f%%  decode %7.1f MB/s  %s\n",
+               limits[i], compressed_size, 100.0 * ((double)compressed_size - (double)base) / (double)base,
+               len / t / 1e6, out && strcmp(out, text) == 0 ? "ok" : "MISMATCH");
+        free(out);
+        free(compressed);
+    }
+}
+
+static void bench_limit(size_t size) {
+    char *text;
+
+    printf("limit: 0 = uncapped\n");
+    text = make_diary_text(size);
+    if (text) {
+        bench_limit_one("diary text", text);
+        free(text);
+    }
+    text = make_skewed_text(size);
+    if (text) {
+        bench_limit_one("skewed", text);
+        free(text);
+    }
+}
+
+static void bench_threads(size_t size) {
+    static const unsigned int counts[] = { 1, 2, 4, 8 };
+    struct compress_options opts;
+    struct timespec start;
+    char *text = make_diary_text(size);
+    size_t len;
+    unsigned int i;
+
+    if (!text) {
+        return;
+    }
+    len = strlen(text);
+    printf("threads: %zu bytes, %u KiB blocks\n", len, COMPRESS_BLOCK_SIZE / 1024);
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        size_t compressed_size;
+        char *compressed, *out;
+        double tc, td;
+
+        compress_default_options(&opts);
+        opts.threads = counts[i];
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        compressed = compress_with_options(text, &compressed_size, &opts);
+        tc = elapsed(&start);
+        if (!compressed) {
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        out = decompress_with_options(compressed, compressed_size, &opts);
+        td = elapsed(&start);
+        printf("  %u thread(s)  compress %7.1f MB/s  decompress %7.1f MB/s  %s\n", counts[i],
+               len / tc / 1e6, len / td / 1e6, out && strcmp(out, text) == 0 ? "ok" : "MISMATCH");
+        free(out);
+        free(compressed);
+    }
+    free(text);
+}
+
+static void bench_histogram_one(const char *label, const unsigned char *data, size_t len) {
+    struct frequency_table simple, kernel, threaded;
+    struct timespec start;
+    double t_simple, t_kernel, t_threaded;
+    size_t i;
+
+    initialise_Frequency(&simple);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < len; i++) {
+        simple.freq[data[i]]++;
+    }
+    t_simple = elapsed(&start);
+
+    initialise_Frequency(&kernel);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    count_frequencies(data, len, &kernel);
+    t_kernel = elapsed(&start);
+
+    initialise_Frequency(&threaded);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    count_frequencies_parallel(data, len, 0, &threaded);
+    t_threaded = elapsed(&start);
+
+    printf("  %-11s simple %7.0f MB/s  kernel %7.0f MB/s  threaded %7.0f MB/s  %s\n", label,
+           len / t_simple / 1e6, len / t_kernel / 1e6, len / t_threaded / 1e6,
+           memcmp(&simple, &kernel, sizeof(simple)) == 0 &&
+           memcmp(&simple, &threaded, sizeof(simple)) == 0 ? "ok" : "MISMATCH");
+}
+
+static void bench_histogram(size_t size) {
+    char *text = make_diary_text(size);
+    unsigned char *run = malloc(size);
+
+    printf("histogram: %zu bytes\n", size);
+    if (text) {
+        bench_histogram_one("diary text", (const unsigned char *)text, strlen(text));
+    }
+    if (run) {
+        memset(run, 'e', size);
+        bench_histogram_one("single byte", run, size);
+    }
+    free(text);
+    free(run);
+}
+
+static void bench_lz(size_t size) {
+    struct compress_options opts;
+    struct timespec start;
+    char *text = make_diary_text(size);
+    size_t len;
+    unsigned int level;
+
+    if (!text) {
+        return;
+    }
+    len = strlen(text);
+    printf("lz: %zu bytes, 1 thread\n", len);
+    for (level = 0; level <= COMPRESS_LEVEL_MAX; level++) {
+        size_t compressed_size;
+        char *compressed, *out;
+        double tc, td;
+
+        compress_default_options(&opts);
+        opts.threads = 1;
+        opts.level = level;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        compressed = compress_with_options(text, &compressed_size, &opts);
+        tc = elapsed(&start);
+        if (!compressed) {
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        out = decompress_with_options(compressed, compressed_size, &opts);
+        td = elapsed(&start);
+        printf("  level %u  ratio %5.2f  compress %7.1f MB/s  decompress %7.1f MB/s  %s\n", level,
+               (double)len / compressed_size, len / tc / 1e6, len / td / 1e6,
+               out && strcmp(out, text) == 0 ? "ok" : "MISMATCH");
+        free(out);
+        free(compressed);
+    }
+    free(text);
+}
+
+static void bench_streams_one(const char *label, const char *text, unsigned int level) {
+    static const unsigned int counts[] = { 1, HUFFMAN_STREAMS };
+    struct compress_options opts;
+    struct timespec start;
+    size_t len = strlen(text);
+    unsigned int i;
+    int round;
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        size_t compressed_size;
+        char *compressed, *out = NULL;
+        double td = 0;
+
+        compress_default_options(&opts);
+        opts.threads = 1;
+        opts.level = level;
+        opts.streams = counts[i];
+        compressed = compress_with_options(text, &compressed_size, &opts);
+        if (!compressed) {
+            continue;
+        }
+        /* best of a few rounds, decoding is quick */
+        for (round = 0; round < 5; round++) {
+            double t;
+            free(out);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            out = decompress_with_options(compressed, compressed_size, &opts);
+            t = elapsed(&start);
+            if (round == 0 || t < td) {
+                td = t;
+            }
+        }
+        printf("  %-8s %u stream(s)  %zu bytes  decompress %7.1f MB/s  %s\n", label, counts[i],
+               compressed_size, len / td / 1e6, out && strcmp(out, text) == 0 ? "ok" : "MISMATCH");
+        free(out);
+        free(compressed);
+    }
+}
+
+static void bench_streams(size_t size) {
+    char *text = make_diary_text(size);
+
+    if (!text) {
+        return;
+    }
+    printf("streams: %zu bytes, 1 thread\n", strlen(text));
+    bench_streams_one("huffman", text, 0);
+    bench_streams_one("lz", text, COMPRESS_LEVEL_DEFAULT);
+    free(text);
+}
+
+static void bench_codec_one(const char *label, const char *text, unsigned int level) {
+    static const enum entropy_codec codecs[] = { CODEC_HUFFMAN, CODEC_ANS };
+    static const char *names[] = { "huffman", "tans" };
+    struct compress_options opts;
+    struct timespec start;
+    size_t len = strlen(text);
+    unsigned int i;
+    int round;
+
+    for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+        size_t compressed_size = 0;
+        char *compressed = NULL, *out = NULL;
+        double tc = 0, td = 0;
+
+        compress_default_options(&opts);
+        opts.threads = 1;
+        opts.level = level;
+        opts.codec = codecs[i];
+        for (round = 0; round < 3; round++) {
+            double t;
+            free(compressed);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            compressed = compress_with_options(text, &compressed_size, &opts);
+            t = elapsed(&start);
+            if (round == 0 || t < tc) {
+                tc = t;
+            }
+        }
+        if (!compressed) {
+            continue;
+        }
+        for (round = 0; round < 5; round++) {
+            double t;
+            free(out);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            out = decompress_with_options(compressed, compressed_size, &opts);
+            t = elapsed(&start);
+            if (round == 0 || t < td) {
+                td = t;
+            }
+        }
+        printf("  %-3s %-8s ratio %5.2f  compress %7.1f MB/s  decompress %7.1f MB/s  %s\n", label,
+               names[i], (double)len / compressed_size, len / tc / 1e6, len / td / 1e6,
+               out && strcmp(out, text) == 0 ? "ok" : "MISMATCH");
+        free(out);
+        free(compressed);
+    }
+}
+
+static void bench_codec(size_t size) {
+    char *text = make_diary_text(size);
+
+    if (!text) {
+        return;
+    }
+    printf("codec: %zu bytes, 1 thread\n", strlen(text));
+    bench_codec_one("l0", text, 0);
+    bench_codec_one("lz", text, COMPRESS_LEVEL_DEFAULT);
+    free(text);
+}
+
+static void bench_multi_one(const char *label, const char *text, unsigned int level,
+                            unsigned int streams) {
+    static const enum huffman_decoder decoders[] = { DECODE_TABLE, DECODE_MULTI };
+    static const char *names[] = { "single", "multi" };
+    struct compress_options opts;
+    struct timespec start;
+    size_t len = strlen(text);
+    size_t compressed_size;
+    char *compressed;
+    unsigned int i;
+    int round;
+
+    compress_default_options(&opts);
+    opts.threads = 1;
+    opts.level = level;
+    opts.streams = streams;
+    compressed = compress_with_options(text, &compressed_size, &opts);
+    if (!compressed) {
+        return;
+    }
+    for (i = 0; i < sizeof(decoders) / sizeof(decoders[0]); i++) {
+        char *out = NULL;
+        double td = 0;
+
+        opts.decoder = decoders[i];
+        for (round = 0; round < 5; round++) {
+            double t;
+            free(out);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            out = decompress_with_options(compressed, compressed_size, &opts);
+            t = elapsed(&start);
+            if (round == 0 || t < td) {
+                td = t;
+            }
+        }
+        printf("  %-3s %u stream(s) %-7s decompress %7.1f MB/s  %s\n", label, streams, names[i],
+               len / td / 1e6, out && strcmp(out, text) == 0 ? "ok" : "MISMATCH");
+        free(out);
+    }
+    free(compressed);
+}
+
+static void bench_multi(size_t size) {
+    char *text = make_diary_text(size);
+
+    if (!text) {
+        return;
+    }
+    printf("multi: %zu bytes, 1 thread\n", strlen(text));
+    bench_multi_one("l0", text, 0, 1);
+    bench_multi_one("l0", text, 0, HUFFMAN_STREAMS);
+    bench_multi_one("lz", text, COMPRESS_LEVEL_DEFAULT, 1);
+    bench_multi_one("lz", text, COMPRESS_LEVEL_DEFAULT, HUFFMAN_STREAMS);
+    free(text);
+}
+
+static void bench_xor(size_t size) {
+    static const enum xorKernel kernels[] = {
+        XOR_KERNEL_SCALAR, XOR_KERNEL_WORD, XOR_KERNEL_SSE2, XOR_KERNEL_AVX2
+    };
+    static const char *names[] = { "scalar", "word", "sse2", "avx2" };
+    char *text = make_diary_text(size);
+    char *reference;
+    struct timespec start;
+    size_t len;
+    unsigned int i;
+    int round;
+
+    if (!text) {
+        return;
+    }
+    len = strlen(text);
+    reference = malloc(len);
+    if (!reference) {
+        free(text);
+        return;
+    }
+    memcpy(reference, text, len);
+    xorSetKernel(XOR_KERNEL_SCALAR);
+    xorEncrypt(reference, len, "diary-password");
+    printf("xor: %zu bytes\n", len);
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        double best = 0;
+
+        if (xorSetKernel(kernels[i]) != 0) {
+            printf("  %-7s not supported here\n", names[i]);
+            continue;
+        }
+        for (round = 0; round < 5; round++) {
+            double t;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            xorEncrypt(text, len, "diary-password");
+            t = elapsed(&start);
+            if (round == 0 || t < best) {
+                best = t;
+            }
+        }
+        /* an odd number of rounds leaves the text encrypted */
+        printf("  %-7s %8.1f MB/s  %s\n", names[i], len / best / 1e6,
+               memcmp(text, reference, len) == 0 ? "ok" : "MISMATCH");
+        xorDecrypt(text, len, "diary-password");
+    }
+    xorSetKernel(XOR_KERNEL_AUTO);
+    free(reference);
+    free(text);
+}
+
+int main(int argc, char **argv) {
+    const char *name = argc > 1 ? argv[1] : "all";
+    size_t size = (argc > 2 ? (size_t)atol(argv[2]) : 4) * 1024 * 1024;
+    int all = strcmp(name, "all") == 0;
+
+    if (all || strcmp(name, "decode") == 0) {
+        bench_decode(size);
+    }
+    if (all || strcmp(name, "build") == 0) {
+        bench_build();
+    }
+    if (all || strcmp(name, "limit") == 0) {
+        bench_limit(size);
+    }
+    if (all || strcmp(name, "threads") == 0) {
+        bench_threads(size);
+    }
+    if (all || strcmp(name, "histogram") == 0) {
+        bench_histogram(size);
+    }
+    if (all || strcmp(name, "lz") == 0) {
+        bench_lz(size);
+    }
+    if (all || strcmp(name, "streams") == 0) {
+        bench_streams(size);
+    }
+    if (all || strcmp(name, "codec") == 0) {
+        bench_codec(size);
+    }
+    if (all || strcmp(name, "multi") == 0) {
+        bench_multi(size);
+    }
+    if (all || strcmp(name, "xor") == 0) {
+        bench_xor(size);
+    }
+    return 0;
+}
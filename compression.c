@@ -6,7 +6,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <ctype.h>
 #include "compression.h"
+#include "parallel.h"
+#include "lz77.h"
+#include "ans.h"
 
 /******  *Function  :  initialise_Frequency
  *Description : initialises all huffman frequency table by setting all of them to 256
@@ -30,17 +35,18 @@ int initialise_Frequency(struct frequency_table *ft){
 }
 
 
-/******  *Function  : int find_min_weight(struct huffman_node **pool, unsigned int limit)
- *Description : find the minimum weight of node in the pool as frequency as primary criterion and level as tie-breaker
- *Parameters : pool - array of pointer to huffman_node
- *              limit - number of valid node
+/******  *Function  : int find_min_weight(const struct huffman_tree *tree)
+ *Description : find the minimum weight of node in the arena as frequency as primary criterion and level as tie-breaker
+ *Parameters : tree - arena whose nodes are the pool, in creation order
  *Effects :
- *Returned : minimum weight
+ *Returned : index of the minimum weight node, -1 if every node is ignored
  */
 
-int find_min_weight(struct huffman_node **pool, unsigned int limit)
+int find_min_weight(const struct huffman_tree *tree)
 {
-    unsigned int i;
+    const struct huffman_node *pool = tree->nodes;
+    int limit = tree->count;
+    int i;
     int min_weight;
     count_Table min_freq;
     int min_level;
@@ -49,11 +55,11 @@ int find_min_weight(struct huffman_node **pool, unsigned int limit)
     min_freq = 0ULL;
     min_level = 0;
 
-    for (i = 0U; i < limit; i++) {
-        if (pool[i] != NULL && pool[i]->ignore == 0) {
-            min_weight = (int)i;
-            min_freq = pool[i]->freq;
-            min_level = pool[i]->level;
+    for (i = 0; i < limit; i++) {
+        if (pool[i].ignore == 0) {
+            min_weight = i;
+            min_freq = pool[i].freq;
+            min_level = pool[i].level;
             break;
         }
     }
@@ -63,150 +69,328 @@ int find_min_weight(struct huffman_node **pool, unsigned int limit)
     }
 
 
-    for (i = (unsigned int)(min_weight + 1); i < limit; i++) {
-        if (pool[i] == NULL || pool[i]->ignore != 0) {
+    for (i = min_weight + 1; i < limit; i++) {
+        if (pool[i].ignore != 0) {
             continue;
         }
-        if (pool[i]->freq < min_freq ||
-            (pool[i]->freq == min_freq && pool[i]->level < min_level)) {
-            min_weight = (int)i;
-            min_freq = pool[i]->freq;
-            min_level = pool[i]->level;
+        if (pool[i].freq < min_freq ||
+            (pool[i].freq == min_freq && pool[i].level < min_level)) {
+            min_weight = i;
+            min_freq = pool[i].freq;
+            min_level = pool[i].level;
             }
     }
 
     return min_weight;
 }
 
-/******  *Function  : struct huffman_node * merge_tree (struct huffman_node *left, struct huffman_node *right)
+/******  *Function  : int merge_tree(struct huffman_tree *tree, int left, int right)
  *Description : merges two composite node into a parent node
- *Parameters : left = left child node
- *              right - right child node
- *Effects : allocates memory for parent and update parent and children pointer
- *Returned : pointer to a parent node or NULL
+ *Parameters : tree - node arena
+ *              left = left child node index
+ *              right - right child node index
+ *Effects : takes the next arena slot for the parent and links parent and children
+ *Returned : index of the parent node or NO_NODE
  */
 
-struct huffman_node * merge_tree (struct huffman_node *left, struct huffman_node *right) {
+int merge_tree (struct huffman_tree *tree, int left, int right) {
     int max_level;
-    struct huffman_node *parent;
+    int index;
+    struct huffman_node *parent, *l, *r;
 
-    if (left == NULL || right == NULL) {
-        return  NULL;
-    }
-    parent = (struct huffman_node *)malloc(sizeof(struct huffman_node));
-    if (parent == NULL) {
-        return NULL;
+    if (tree == NULL || left < 0 || right < 0 ||
+        left >= tree->count || right >= tree->count || tree->count >= MAX_TREE_NODES) {
+        return  NO_NODE;
     }
+    index = tree->count++;
+    parent = &tree->nodes[index];
+    l = &tree->nodes[left];
+    r = &tree->nodes[right];
 
     parent -> value = COMPOSITE_NODE;  /*integrates other nodes by linking their ports*/
-    parent -> freq = left -> freq + right -> freq;  /* sum weights */
+    parent -> freq = l -> freq + r -> freq;  /* sum weights */
 
-    if (left -> level > right -> level) {
-        max_level = left -> level;
+    if (l -> level > r -> level) {
+        max_level = l -> level;
     } else {
-        max_level = right->level;
+        max_level = r->level;
     }
     parent -> level = max_level + 1;
 
     parent -> ignore = 0;
     parent -> left = left;
     parent -> right = right;
-    parent -> parent = NULL;
+    parent -> parent = NO_NODE;
 
-    left-> parent = parent;
-    right-> parent = parent;
-    left -> ignore = 1;
-    right -> ignore = 1;
+    l-> parent = index;
+    r-> parent = index;
+    l -> ignore = 1;
+    r -> ignore = 1;
 
-    return parent;
+    return index;
 }
 
 
-/******  *Function  : static struct huffman_node*create_leaf_node(int symbol, count_Table freq)
- *Description :
- *Parameters :
- *Effects :
- *Returned :
+/******  *Function  : static int create_leaf_node(struct huffman_tree *tree, int symbol, count_Table freq)
+ *Description : adds a leaf for symbol to the arena
+ *Parameters : tree - node arena, symbol - byte value, freq - its count
+ *Effects : takes the next arena slot
+ *Returned : index of the leaf or NO_NODE when the arena is full
  */
 
 
-static struct huffman_node*create_leaf_node(int symbol, count_Table freq) {
+static int create_leaf_node(struct huffman_tree *tree, int symbol, count_Table freq) {
     struct huffman_node *node;
-    node = (struct huffman_node *)malloc(sizeof(struct huffman_node));
-    if (node == NULL) {
-        return NULL;
+
+    if (tree->count >= MAX_TREE_NODES) {
+        return NO_NODE;
     }
+    node = &tree->nodes[tree->count];
     node->value = symbol;
     node->freq = freq;
     node->level = 0;
     node->ignore = 0;
-    node->left = NULL;
-    node->right = NULL;
-    node->parent = NULL;
+    node->left = NO_NODE;
+    node->right = NO_NODE;
+    node->parent = NO_NODE;
 
-    return node;
+    return tree->count++;
 }
 
 
-/******  *Function  : int build_Tree(const struct frequency_table *ft, struct huffman_node **out_root)
- *Description :
+/******  *Function  : static struct huffman_tree *create_tree(void)
+ *Description : allocates an empty node arena
  *Parameters :
- *Effects :
- *Returned :
+ *Effects : one allocation holds every node of the tree
+ *Returned : the arena or NULL
+ */
+
+static struct huffman_tree *create_tree(void) {
+    struct huffman_tree *tree;
+
+    tree = (struct huffman_tree *)malloc(sizeof(struct huffman_tree));
+    if (tree == NULL) {
+        return NULL;
+    }
+    tree->count = 0;
+    tree->root = NO_NODE;
+    return tree;
+}
+
+
+/******  *Function  : int build_Tree(const struct frequency_table *ft, struct huffman_tree **out_tree)
+ *Description : builds the Huffman tree for a frequency table
+ *Parameters : ft - frequency table, out_tree - receives the tree
+ *Effects : the tree is released with free_huffman_tree
+ *Returned : 0 on success, -1 on failure or an empty table
+ */
+
+
+int build_Tree(const struct frequency_table *ft, struct huffman_tree **out_tree) {  /* out tree is the pointer inside the pointer*/
+    struct huffman_tree *tree;
+
+    if (ft == NULL || out_tree == NULL) {
+        return -1;
+    }
+    *out_tree = NULL;
+
+    tree = build_tree_from_frequency_heap(ft);
+    if (tree == NULL) {
+        return -1;
+    }
+    *out_tree = tree;
+    return 0;
+}
+
+/******  *Function  : static void histogram_kernel(const unsigned char *data, size_t len, count_Table *freq)
+ *Description : adds the byte counts of data to freq
+ *Parameters : data - bytes to count, len - number of bytes
+ *              freq - NUM_SYMBOLS counters to add to
+ *Effects : bytes are spread over four 32-bit count tables, loaded eight at a
+ *          time, so runs of the same byte do not stall on incrementing one
+ *          counter; the tables are folded into freq every HISTOGRAM_CHUNK bytes
+ *          before they can overflow
+ *Returned : none
  */
 
+#define HISTOGRAM_CHUNK         ((size_t)1 << 30)
+#define HISTOGRAM_PARALLEL_MIN  ((size_t)1 << 20)
 
-int build_Tree(const struct frequency_table *ft, struct huffman_node **out_root) {  /* out root is the pointer inside the pointer*/
-    struct huffman_node *root;
+static void histogram_kernel(const unsigned char *data, size_t len, count_Table *freq) {
+    uint32_t counts[4][NUM_SYMBOLS];
+    unsigned int i;
+
+    memset(counts, 0, sizeof(counts));
+    while (len > 0) {
+        size_t chunk = len < HISTOGRAM_CHUNK ? len : HISTOGRAM_CHUNK;
+        const unsigned char *p = data;
+        const unsigned char *end = data + chunk;
+
+        while (end - p >= 16) {
+            uint64_t a, b;
+            memcpy(&a, p, 8);
+            memcpy(&b, p + 8, 8);
+            counts[0][a & 0xFF]++;
+            counts[1][(a >> 8) & 0xFF]++;
+            counts[2][(a >> 16) & 0xFF]++;
+            counts[3][(a >> 24) & 0xFF]++;
+            counts[0][(a >> 32) & 0xFF]++;
+            counts[1][(a >> 40) & 0xFF]++;
+            counts[2][(a >> 48) & 0xFF]++;
+            counts[3][a >> 56]++;
+            counts[0][b & 0xFF]++;
+            counts[1][(b >> 8) & 0xFF]++;
+            counts[2][(b >> 16) & 0xFF]++;
+            counts[3][(b >> 24) & 0xFF]++;
+            counts[0][(b >> 32) & 0xFF]++;
+            counts[1][(b >> 40) & 0xFF]++;
+            counts[2][(b >> 48) & 0xFF]++;
+            counts[3][b >> 56]++;
+            p += 16;
+        }
+        while (p < end) {
+            counts[0][*p++]++;
+        }
+
+        for (i = 0U; i < NUM_SYMBOLS; i++) {
+            freq[i] += (count_Table)counts[0][i] + counts[1][i] + counts[2][i] + counts[3][i];
+        }
+        memset(counts, 0, sizeof(counts));
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+
+/* Per-thread tables for count_frequencies_parallel */
+struct histogram_job {
+    const unsigned char *data;
+    size_t len;
+    size_t part;
+    struct frequency_table *tables;
+};
+
+static void histogram_task(void *ctx, size_t index) {
+    struct histogram_job *job = (struct histogram_job *)ctx;
+    size_t start = index * job->part;
+    size_t len = job->len - start < job->part ? job->len - start : job->part;
+
+    initialise_Frequency(&job->tables[index]);
+    histogram_kernel(job->data + start, len, job->tables[index].freq);
+}
+
+
+/******  *Function  : int count_frequencies(const unsigned char *data, size_t len, struct frequency_table *ft)
+ *Description : tallies the bytes of a buffer into ft->freq[]
+ *Parameters : data - buffer, len - its size, ft - table to add to
+ *Effects : counts are added, so a stream can be counted a buffer at a time
+ *Returned : 0 on success and -1 on fail
+ */
+
+int count_frequencies(const unsigned char *data, size_t len, struct frequency_table *ft) {
+    if ((data == NULL && len > 0) || ft == NULL) {
+        return -1;
+    }
+    histogram_kernel(data, len, ft->freq);
+    return 0;
+}
+
+
+/******  *Function  : int count_frequencies_parallel(const unsigned char *data, size_t len, unsigned int threads, struct frequency_table *ft)
+ *Description : count_frequencies split over several threads
+ *Parameters : data - buffer, len - its size
+ *              threads - thread limit (0 = one per core), ft - table to add to
+ *Effects : each thread counts its own slice into a private frequency_table
+ *          and the tables are summed afterwards; slices are at least
+ *          HISTOGRAM_PARALLEL_MIN bytes, so small buffers stay on one thread
+ *Returned : 0 on success and -1 on fail
+ */
+
+int count_frequencies_parallel(const unsigned char *data, size_t len, unsigned int threads,
+                               struct frequency_table *ft) {
+    struct histogram_job job;
+    size_t parts, index;
+    unsigned int i;
 
-    if (ft == NULL || out_root == NULL) {
+    if ((data == NULL && len > 0) || ft == NULL) {
         return -1;
     }
-    *out_root = NULL;
+    if (threads == 0) {
+        threads = parallel_cpu_count();
+    }
+    parts = len / HISTOGRAM_PARALLEL_MIN;
+    if (parts > threads) {
+        parts = threads;
+    }
+    if (parts <= 1) {
+        return count_frequencies(data, len, ft);
+    }
 
-    root = build_tree_from_frequency(ft);
-    if (root == NULL) {
+    job.data = data;
+    job.len = len;
+    job.part = (len + parts - 1) / parts;
+    job.tables = malloc(parts * sizeof(*job.tables));
+    if (job.tables == NULL) {
+        return count_frequencies(data, len, ft);
+    }
+    if (parallel_for(parts, (unsigned int)parts, histogram_task, &job) != 0) {
+        free(job.tables);
         return -1;
     }
-    *out_root = root;
+    for (index = 0; index < parts; index++) {
+        for (i = 0U; i < NUM_SYMBOLS; i++) {
+            ft->freq[i] += job.tables[index].freq[i];
+        }
+    }
+    free(job.tables);
     return 0;
 }
 
+
 /******  *Function  : count_Freq
- *Description : count all the char one by one and tallies them to ft->freq[]
- *Parameters :
+ *Description : reads the rest of a file and tallies its bytes to ft->freq[]
+ *Parameters : input - open file, ft - table to add to
  *Effects : this will count the freq so it can be used to weight to create the greedy algo.
- *Returned : 1 on success and 0 on failure
+ *          The file is read in large blocks that are counted on several threads
+ *Returned : 0 on success and -1 on failure
  */
 
+#define COUNT_BUFFER_SIZE ((size_t)4 << 20)
+
 int count_Freq(FILE*input,struct frequency_table*ft) {
 
-    int character; /* count character to give them weight*/
+    unsigned char *buffer; /* count character to give them weight*/
+    size_t got;
 
     if (input == NULL || ft == NULL) {
         return -1;
     }
 
-    while ((character = fgetc(input)) != EOF) {
-        ft->freq[(unsigned char)character]++;
+    buffer = malloc(COUNT_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return -1;
     }
 
-    return 0;
+    while ((got = fread(buffer, 1, COUNT_BUFFER_SIZE, input)) > 0) {
+        count_frequencies_parallel(buffer, got, 0, ft);
+    }
+
+    free(buffer);
+    return ferror(input) ? -1 : 0;
 }
 
 
 /******  *Function  : build_tree_using_greedy
  *Description : Builds Huffman tree using greedy algorithm
  *Parameters : ft - frequency table with symbol counts
- *Effects :  allocates memory for tree nodes
- *Returned : root of huffman tree
+ *Effects :  allocates the node arena
+ *Returned : huffman tree, or NULL if no symbol has a count
  */
 
-struct huffman_node *build_tree_from_frequency(const struct frequency_table *ft) {
-    struct huffman_node * pool[NUM_SYMBOLS *2];
-    unsigned int pool_size = 0;
+struct huffman_tree *build_tree_from_frequency(const struct frequency_table *ft) {
+    struct huffman_tree *tree;
     unsigned int i;
-    struct huffman_node *merged;
+    int merged;
     int min1, min2;
     int create_Tree = 1;  // 1 = true, 0 = false
 
@@ -215,56 +399,152 @@ struct huffman_node *build_tree_from_frequency(const struct frequency_table *ft)
     if (ft == NULL) {
         return NULL;
     }
+    tree = create_tree();
+    if (tree == NULL) {
+        return NULL;
+    }
 
     for (i = 0U; i < NUM_SYMBOLS; i++) {
         if (ft->freq[i] > 0UL) {
-            pool[pool_size] = create_leaf_node((int)i, ft->freq[i]);
-            if (pool[pool_size] == NULL) {
-                while (pool_size > 0) {
-                    free(pool[--pool_size]);
-                }
-                return NULL;
-            }
-            pool_size++;
+            create_leaf_node(tree, (int)i, ft->freq[i]);
         }
     }
 
-    if (pool_size == 0) {
+    if (tree->count == 0) {
+        free(tree);
         return NULL;
     }
-    if (pool_size == 1) {
-        return pool[0];
-    }
 
     while (create_Tree) {
-        min1 = find_min_weight(pool, pool_size);
+        min1 = find_min_weight(tree);
 
         if (min1 == -1) {
             break;
         }
-        pool[min1]-> ignore = 2; 
-        min2 = find_min_weight(pool, pool_size);
-        pool[min1]-> ignore = 0;
+        tree->nodes[min1].ignore = 2; 
+        min2 = find_min_weight(tree);
+        tree->nodes[min1].ignore = 0;
 
         if (min2 == -1) {
-            return pool[min1];
+            tree->root = min1;
+            return tree;
         }
 
-        merged = merge_tree(pool[min1], pool[min2]);
-        if (merged == NULL) {
+        merged = merge_tree(tree, min1, min2);
+        if (merged == NO_NODE) {
+            free(tree);
             return NULL;
         }
+    }
 
-        pool[pool_size] = merged;
-        pool_size++;
+    free(tree);
+    return NULL;
+}
+
+
+/******  *Function  : static int node_before(const struct huffman_node *pool, int a, int b)
+ *Description : ordering used by find_min_weight: frequency first, then level,
+ *              then position in the arena
+ *Parameters : pool - arena nodes
+ *              a, b - node indexes to compare
+ *Effects :
+ *Returned : 1 if pool[a] is merged before pool[b], 0 otherwise
+ */
+
+static int node_before(const struct huffman_node *pool, int a, int b) {
+    if (pool[a].freq != pool[b].freq) {
+        return pool[a].freq < pool[b].freq;
+    }
+    if (pool[a].level != pool[b].level) {
+        return pool[a].level < pool[b].level;
     }
+    return a < b;
+}
+
+static void heap_push(int *heap, unsigned int *heap_size,
+                      const struct huffman_node *pool, int index) {
+    unsigned int child = (*heap_size)++;
 
-    for (i = 0U; i < pool_size; i++) {
-        if (pool[i] != NULL && pool[i]->ignore == 0) {
-            return pool[i];
+    while (child > 0) {
+        unsigned int parent = (child - 1) / 2;
+        if (!node_before(pool, index, heap[parent])) {
+            break;
         }
+        heap[child] = heap[parent];
+        child = parent;
     }
-    return NULL;
+    heap[child] = index;
+}
+
+static int heap_pop(int *heap, unsigned int *heap_size, const struct huffman_node *pool) {
+    int top = heap[0];
+    int last = heap[--(*heap_size)];
+    unsigned int hole = 0;
+
+    for (;;) {
+        unsigned int child = 2 * hole + 1;
+        if (child >= *heap_size) {
+            break;
+        }
+        if (child + 1 < *heap_size && node_before(pool, heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!node_before(pool, heap[child], last)) {
+            break;
+        }
+        heap[hole] = heap[child];
+        hole = child;
+    }
+    if (*heap_size > 0) {
+        heap[hole] = last;
+    }
+    return top;
+}
+
+
+/******  *Function  : struct huffman_tree *build_tree_from_frequency_heap(const struct frequency_table *ft)
+ *Description : Builds the same Huffman tree as build_tree_from_frequency, taking
+ *              the two lightest nodes from a binary min-heap instead of
+ *              scanning the whole arena for each of them
+ *Parameters : ft - frequency table with symbol counts
+ *Effects :  allocates the node arena; O(n log n) in the number of symbols
+ *Returned : huffman tree, or NULL if no symbol has a count
+ */
+
+struct huffman_tree *build_tree_from_frequency_heap(const struct frequency_table *ft) {
+    struct huffman_tree *tree;
+    int heap[MAX_TREE_NODES];
+    unsigned int heap_size = 0;
+    unsigned int i;
+
+    if (ft == NULL) {
+        return NULL;
+    }
+    tree = create_tree();
+    if (tree == NULL) {
+        return NULL;
+    }
+
+    for (i = 0U; i < NUM_SYMBOLS; i++) {
+        if (ft->freq[i] > 0UL) {
+            heap_push(heap, &heap_size, tree->nodes, create_leaf_node(tree, (int)i, ft->freq[i]));
+        }
+    }
+
+    if (heap_size == 0) {
+        free(tree);
+        return NULL;
+    }
+
+    while (heap_size > 1) {
+        int min1 = heap_pop(heap, &heap_size, tree->nodes);
+        int min2 = heap_pop(heap, &heap_size, tree->nodes);
+
+        heap_push(heap, &heap_size, tree->nodes, merge_tree(tree, min1, min2));
+    }
+
+    tree->root = heap[0];
+    return tree;
 }
 
 /******  *Function  : int initialise_code_table(struct code_table *ct)
@@ -283,67 +563,48 @@ int initialise_code_table(struct code_table *ct) {
     }
 
     for (i = 0U; i < NUM_SYMBOLS; i++) {
-        ct->length[i] = 0UL;
-        ct->code[i][0] = '\0';
+        ct->length[i] = 0U;
+        ct->code[i] = 0U;
     }
 
     return 0;
 }
 
 
-/******  *Function  : static void determine_path(struct huffman_node *node,struct code_table *ct,char *current_code,unsigned int depth)
- *Description :
- *Parameters :
- *Effects :
- *Returned :
+/******  *Function  : static void determine_path(const struct huffman_tree *tree, int index, struct code_table *ct, unsigned int depth)
+ *Description : walks the tree and records the depth of every leaf as its code length
+ *Parameters : tree - node arena, index - node to visit
+ *              ct - code table to fill, depth - length of the path so far
+ *Effects : the codes themselves are canonical, so only lengths are needed
+ *Returned : none
  */
 
 
-static void determine_path(struct huffman_node *node,struct code_table *ct,char *current_code,unsigned int depth) {
-
-    if (node->left == NULL && node->right == NULL) {
-        unsigned int i;
-        int symbol ;
-        symbol = node->value;
-
-
-        for (i = 0U; i < depth; i++) {
-            ct->code[symbol][i] = current_code[i];
-        }
-        ct->code[symbol][depth] = '\0';
-        ct->length[symbol] = depth;
+static void determine_path(const struct huffman_tree *tree, int index, struct code_table *ct, unsigned int depth) {
+    const struct huffman_node *node = &tree->nodes[index];
 
+    if (node->left == NO_NODE && node->right == NO_NODE) {
+        ct->length[node->value] = (unsigned char)depth;
         return;
     }
 
 
-    if (node->left != NULL) {
-        current_code[depth] = '0';
-        determine_path(node->left, ct, current_code, depth + 1);
+    if (node->left != NO_NODE) {
+        determine_path(tree, node->left, ct, depth + 1);
     }
 
 
-    if (node->right != NULL) {
-        current_code[depth] = '1';
-        determine_path(node->right, ct, current_code, depth + 1);
+    if (node->right != NO_NODE) {
+        determine_path(tree, node->right, ct, depth + 1);
     }
 }
 
 
-/******  *Function  : static void determine_path(struct huffman_node *node,struct code_table *ct,char *current_code,unsigned int depth)
- *Description :
- *Parameters :
- *Effects :
- *Returned :
- */
-
-
-
-int generate_encoding(struct huffman_node *node, struct code_table*ct) {
-
-    char current_code[NUM_SYMBOLS];
+/* Code lengths of the leaves of tree; a single leaf gets length 1 */
+static int tree_code_lengths(const struct huffman_tree *tree, struct code_table *ct) {
+    const struct huffman_node *node;
 
-    if (node == NULL || ct == NULL) {
+    if (tree == NULL || tree->root == NO_NODE || ct == NULL) {
         return -1;
     }
 
@@ -351,186 +612,377 @@ int generate_encoding(struct huffman_node *node, struct code_table*ct) {
         return -1;
     }
 
-
-    if (node -> left == NULL && node -> right == NULL) {
+    node = &tree->nodes[tree->root];
+    if (node -> left == NO_NODE && node -> right == NO_NODE) {
         int sysm;
         sysm = node -> value;
         if (sysm >= 0 && sysm < (int)NUM_SYMBOLS) {
-            ct->code[(unsigned)sysm][0] = '0';
-            ct->code[(unsigned)sysm][1] = '\0';
             ct->length[(unsigned)sysm] = 1U;
         }
         return 0;
     }
-    determine_path((struct huffman_node *)node, ct, current_code, 0U);
+    determine_path(tree, tree->root, ct, 0U);
     return 0;
 }
 
 
-/******  *Function  : void free_huffman_tree(struct huffman_node *root)
- *Description :
- *Parameters :
- *Effects :
- *Returned :
+/******  *Function  : int generate_encoding(const struct huffman_tree *tree, struct code_table *ct)
+ *Description : fills ct with the canonical codes for the leaves of tree
+ *Parameters : tree - huffman tree, ct - code table to fill
+ *Effects : a tree with a single leaf gets the one bit code "0"; the
+ *          lengths are filled in even when the tree is too deep for codes
+ *Returned : 0 on success, -1 on fail or if a code is longer than
+ *           HUFFMAN_MAX_BITS (generate_limited_encoding() caps them)
  */
 
 
 
-void free_huffman_tree(struct huffman_node *node){
-
-    if (!node) {
-        return;
+int generate_encoding(const struct huffman_tree *tree, struct code_table*ct) {
+    if (tree_code_lengths(tree, ct) != 0) {
+        return -1;
     }
-
-    free_huffman_tree(node->left);
-    free_huffman_tree(node->right);
-    free(node);
+    return assign_canonical_codes(ct);
 }
 
 
-/******  *Function  : int encode_file(FILE*input, FILE*output, struct code_table *ct)
- *Description :
- *Parameters :
- *Effects :
- *Returned :
+/******  *Function  : int assign_canonical_codes(struct code_table *ct)
+ *Description : replaces the codes in ct with canonical Huffman codes of the same lengths
+ *Parameters : ct - code table whose length[] array is filled in
+ *Effects : codes are handed out in order of (length, symbol), each one the
+ *          previous code plus one, shifted left when the length grows, so
+ *          the lengths alone are enough to rebuild the table
+ *Returned : 0 on success, -1 if the lengths do not form a prefix code or
+ *           one is longer than HUFFMAN_MAX_BITS
  */
 
+int assign_canonical_codes(struct code_table *ct) {
+    unsigned int count[HUFFMAN_MAX_BITS + 1] = {0};
+    uint64_t next[HUFFMAN_MAX_BITS + 1];
+    uint64_t code = 0;
+    unsigned int length, symbol;
 
-
-int encode_file(FILE*input, FILE*output, struct code_table *ct){
-    int character;
-    unsigned int i;
-    unsigned char symbol;
-
-    if (input == NULL || output == NULL || ct == NULL){
+    if (ct == NULL) {
         return -1;
     }
 
-    rewind(input);
-
-    while ((character = fgetc(input)) != EOF) {
-        symbol = (unsigned char)character;
-
-        for (i = 0; i <ct->length[symbol]; i++) {
-            fputc(ct->code[symbol][i], output);
+    for (symbol = 0U; symbol < NUM_SYMBOLS; symbol++) {
+        if (ct->length[symbol] > HUFFMAN_MAX_BITS) {
+            return -1;
         }
+        count[ct->length[symbol]]++;
     }
 
+    /* each length starts just past the shorter codes, one bit longer */
+    count[0] = 0;
+    for (length = 1U; length <= HUFFMAN_MAX_BITS; length++) {
+        code = (code + count[length - 1]) << 1;
+        next[length] = code;
+        /* running out of codes of this length means it is not a prefix code */
+        if (code + count[length] > (uint64_t)1 << length) {
+            return -1;
+        }
+    }
+    for (symbol = 0U; symbol < NUM_SYMBOLS; symbol++) {
+        length = ct->length[symbol];
+        if (length > 0) {
+            ct->code[symbol] = (uint32_t)next[length]++;
+        }
+    }
     return 0;
 }
 
 
-/******  *Function  : int encode_file(FILE*input, FILE*output, struct code_table *ct)
- *Description :
- *Parameters :
- *Effects :
- *Returned :
+/******  *Function  : static void count_package(...)
+ *Description : adds one to the code length of every leaf under a package-merge item
+ *Parameters : items - item lists, one per level, level - list of the item
+ *              index - item in that list, width - list stride, lengths - output
+ *Effects : a leaf item is one symbol; a package stands for the two items it
+ *          was made from one level deeper
+ *Returned : none
  */
 
+struct pm_item {
+    count_Table weight;
+    int symbol;          /* leaf symbol, or -1 for a package */
+    unsigned int first;  /* package: index of its first item one level deeper */
+};
 
+static void count_package(const struct pm_item *items, unsigned int level, unsigned int index,
+                          unsigned int width, unsigned int *lengths) {
+    const struct pm_item *item = &items[level * width + index];
 
-int compress_file(const char *input_file, const char *output_file) {
-    FILE *input, *output;
-    struct frequency_table ft;
-    struct code_table ct;
-    struct huffman_node *node;
-
-    input = fopen(input_file, "rb");
-    if (input == NULL) {
-        return -1;
+    if (item->symbol >= 0) {
+        lengths[item->symbol]++;
+        return;
     }
+    count_package(items, level + 1, item->first, width, lengths);
+    count_package(items, level + 1, item->first + 1, width, lengths);
+}
 
-    initialise_Frequency(&ft);
-    if (count_Freq(input, &ft) != 0) {
-        fclose(input);
+
+/******  *Function  : int generate_limited_encoding(const struct frequency_table *ft, unsigned int max_len, struct code_table *ct)
+ *Description : fills ct with the optimal canonical code whose lengths do not exceed max_len
+ *Parameters : ft - frequency table, max_len - longest code allowed
+ *              ct - code table to fill
+ *Effects : package-merge: the list for the deepest level holds the leaves
+ *          sorted by weight; each shallower list merges the leaves with
+ *          pairs packaged from the list below. The cheapest 2n-2 items of
+ *          the top list give every symbol its code length. max_len is
+ *          raised when it is too short for the number of symbols
+ *Returned : 0 on success and -1 on fail
+ */
+
+int generate_limited_encoding(const struct frequency_table *ft, unsigned int max_len, struct code_table *ct) {
+    struct pm_item leaves[NUM_SYMBOLS];
+    struct pm_item *items;
+    unsigned int list_size[MAX_CODE_LEN];
+    unsigned int lengths[NUM_SYMBOLS] = {0};
+    unsigned int n = 0;
+    unsigned int width, level, i, j;
+
+    if (ft == NULL || ct == NULL || initialise_code_table(ct) != 0) {
         return -1;
     }
 
-    if (build_Tree(&ft, &node) != 0) {
-        fclose(input);
-        return -1;
+    /* leaves in ascending weight, ties by symbol */
+    for (i = 0U; i < NUM_SYMBOLS; i++) {
+        if (ft->freq[i] == 0ULL) {
+            continue;
+        }
+        j = n++;
+        while (j > 0 && leaves[j - 1].weight > ft->freq[i]) {
+            leaves[j] = leaves[j - 1];
+            j--;
+        }
+        leaves[j].weight = ft->freq[i];
+        leaves[j].symbol = (int)i;
+        leaves[j].first = 0;
     }
 
-    if (generate_encoding(node, &ct) != 0) {
-        free_huffman_tree(node);
-        fclose(input);
+    if (n == 0) {
         return -1;
     }
+    if (n == 1) {
+        ct->length[leaves[0].symbol] = 1U;
+        return assign_canonical_codes(ct);
+    }
+    if (max_len > n - 1) {
+        max_len = n - 1;  /* no Huffman code is deeper than this anyway */
+    }
+    while (max_len < 9U && (1U << max_len) < n) {
+        max_len++;
+    }
 
-    output = fopen(output_file, "wb");
-    if (output == NULL) {
-        free_huffman_tree(node);
-        fclose(input);
+    width = 2 * n;
+    items = malloc((size_t)max_len * width * sizeof(*items));
+    if (items == NULL) {
         return -1;
     }
 
-    encode_file(input, output, &ct);
-    free_huffman_tree(node);
-    fclose(input);
-    fclose(output);
-    
-    return 0;
-}
+    /* level max_len - 1 is the deepest list, level 0 the top one */
+    level = max_len - 1;
+    memcpy(&items[level * width], leaves, n * sizeof(*items));
+    list_size[level] = n;
 
+    while (level-- > 0) {
+        const struct pm_item *below = &items[(level + 1) * width];
+        struct pm_item *list = &items[level * width];
+        unsigned int packages = list_size[level + 1] / 2;
+        unsigned int leaf = 0, package = 0, count = 0;
 
+        while (leaf < n || package < packages) {
+            count_Table package_weight = 0;
 
-/******  *Function  : int encode_file(FILE*input, FILE*output, struct code_table *ct)
- *Description :
- *Parameters :
- *Effects :
- *Returned :
- */
+            if (package < packages) {
+                package_weight = below[2 * package].weight + below[2 * package + 1].weight;
+            }
+            /* on equal weight the leaf goes first */
+            if (package >= packages || (leaf < n && leaves[leaf].weight <= package_weight)) {
+                list[count++] = leaves[leaf++];
+            } else {
+                list[count].weight = package_weight;
+                list[count].symbol = -1;
+                list[count].first = 2 * package;
+                count++;
+                package++;
+            }
+        }
+        list_size[level] = count;
+    }
 
+    for (i = 0U; i < 2 * n - 2; i++) {
+        count_package(items, 0, i, width, lengths);
+    }
+    free(items);
+    for (i = 0U; i < NUM_SYMBOLS; i++) {
+        ct->length[i] = (unsigned char)lengths[i];
+    }
 
+    return assign_canonical_codes(ct);
+}
 
-int save_Tree(const char *filename, struct code_table *ct){
-    FILE *file;
-    unsigned int i;
-    unsigned int count = 0;
 
-    if (filename == NULL || ct == NULL){
-        return -1;
-    }
+/* Code lengths of the built-in table, by byte value. Trained on licence
+ * prose and diary sentences wrapped in the serializeEntries() layout,
+ * every count raised by one so no byte is left without a code */
+static const unsigned char static_code_lengths[NUM_SYMBOLS] = {
+    11, 11, 11, 11, 11, 11, 11, 11, 11, 11,  7, 11, 11, 11, 11, 11,
+    11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+     3, 10, 10, 11, 11, 11, 11,  8, 10, 10,  9, 11,  7,  7,  7, 11,
+     7,  8,  7,  9,  9,  8, 10, 10, 10, 10,  7, 10, 11, 11, 11, 10,
+    11,  8, 11,  8,  7,  7, 11, 11, 11,  7, 11, 11,  9, 10,  6,  7,
+    10, 11,  7,  8,  6,  9, 11,  8, 11,  8, 11, 11, 11, 11, 11,  8,
+    11,  4,  7,  6,  6,  4,  6,  6,  5,  5, 11,  7,  5,  6,  5,  4,
+     6, 11,  5,  5,  4,  6,  8,  6,  9,  6, 11, 11, 11, 11, 11, 11,
+    11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+    11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+    11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+    11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+    11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+    11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+    11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+    11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+};
+
+
+/******  *Function  : int static_code_table(struct code_table *ct)
+ *Description : fills ct with the built-in code table
+ *Parameters : ct - code table to fill
+ *Effects :
+ *Returned : 0 on success, -1 on failure
+ */
 
-    file = fopen(filename, "w");
-    if (file == NULL){
+int static_code_table(struct code_table *ct) {
+    if (ct == NULL) {
         return -1;
     }
+    memcpy(ct->length, static_code_lengths, sizeof(ct->length));
+    return assign_canonical_codes(ct);
+}
+
 
-    fprintf(file, "HUFFMAN_TREE\n");
+/******  *Function  : size_t write_code_lengths(const struct code_table *ct, unsigned char *out)
+ *Description : writes the code length header for a canonical code table
+ *Parameters : ct - code table
+ *              out - at least CODE_LENGTHS_MAX_SIZE bytes
+ *Effects : byte 0 is the longest code length and byte 1 the number of coded
+ *          symbols minus one. Small alphabets follow as (symbol, length)
+ *          pairs; otherwise all 256 lengths follow, as nibbles when the
+ *          longest is 15 or less and as bytes when it is not
+ *Returned : number of bytes written
+ */
+
+size_t write_code_lengths(const struct code_table *ct, unsigned char *out) {
+    unsigned int max_len = 0;
+    unsigned int count = 0;
+    size_t dense_size;
+    size_t pos = 2;
+    unsigned int i;
 
-    for (i=0; i<NUM_SYMBOLS; i++){
-        if(ct->length[i] > 0UL){
+    for (i = 0U; i < NUM_SYMBOLS; i++) {
+        if (ct->length[i] > 0U) {
             count++;
         }
+        if (ct->length[i] > max_len) {
+            max_len = ct->length[i];
+        }
     }
+    out[0] = (unsigned char)max_len;
+    out[1] = (unsigned char)(count - 1U);
+    dense_size = max_len <= 15U ? NUM_SYMBOLS / 2 : NUM_SYMBOLS;
 
-    fprintf(file, "%u\n", count);
-
-    for (i = 0U; i<NUM_SYMBOLS; i++){
-        if (ct->length[i] > 0UL){
-            if (i == '\n'){
-                fprintf(file, "\\n %s %u\n", ct->code[i], ct->length[i]);
-            }
-            else if (i == ' '){
-                fprintf(file, "\\s %s %u\n", ct->code[i], ct->length[i]);
-            }
-            else if (i == '\\'){
-                fprintf(file, "\\\\ %s %u\n", ct->code[i], ct->length[i]);
-            }
-            else if ( i>= 32 && i <=126){
-                fprintf(file, "%c %s %u\n", (char)i,ct->code[i], ct->length[i]);
-            }
-            else{
-                fprintf(file, "\\x%02X %s %u\n", i, ct->code[i], ct->length[i]);
+    if (2U * count < dense_size) {
+        for (i = 0U; i < NUM_SYMBOLS; i++) {
+            if (ct->length[i] > 0U) {
+                out[pos++] = (unsigned char)i;
+                out[pos++] = (unsigned char)ct->length[i];
             }
         }
+        return pos;
     }
-
-    fclose(file);
+    if (max_len <= 15U) {
+        for (i = 0U; i < NUM_SYMBOLS; i += 2) {
+            out[pos++] = (unsigned char)(ct->length[i] | (ct->length[i + 1] << 4));
+        }
+        return pos;
+    }
+    for (i = 0U; i < NUM_SYMBOLS; i++) {
+        out[pos++] = (unsigned char)ct->length[i];
+    }
+    return pos;
+}
 
 
-    return 0;
+/******  *Function  : long read_code_lengths(const unsigned char *in, size_t size, struct code_table *ct)
+ *Description : reads a header written by write_code_lengths and rebuilds the canonical codes
+ *Parameters : in - header bytes, size - bytes available
+ *              ct - code table to fill
+ *Effects : a lone CODE_LENGTHS_STATIC byte gives the built-in table
+ *Returned : number of bytes consumed, -1 on a truncated or invalid header
+ */
+
+long read_code_lengths(const unsigned char *in, size_t size, struct code_table *ct) {
+    unsigned int max_len, count, i;
+    size_t dense_size, needed;
+
+    if (in == NULL || ct == NULL || size < 1 || initialise_code_table(ct) != 0) {
+        return -1;
+    }
+    if (in[0] == CODE_LENGTHS_STATIC) {
+        return static_code_table(ct) != 0 ? -1 : 1;
+    }
+    if (size < 2) {
+        return -1;
+    }
+    max_len = in[0];
+    count = in[1] + 1U;
+    dense_size = max_len <= 15U ? NUM_SYMBOLS / 2 : NUM_SYMBOLS;
+
+    if (2U * count < dense_size) {
+        needed = 2 + 2 * (size_t)count;
+        if (size < needed) {
+            return -1;
+        }
+        for (i = 0U; i < count; i++) {
+            ct->length[in[2 + 2 * i]] = in[3 + 2 * i];
+        }
+    } else {
+        needed = 2 + dense_size;
+        if (size < needed) {
+            return -1;
+        }
+        for (i = 0U; i < NUM_SYMBOLS; i++) {
+            if (max_len <= 15U) {
+                ct->length[i] = (in[2 + i / 2] >> ((i & 1U) * 4)) & 0x0FU;
+            } else {
+                ct->length[i] = in[2 + i];
+            }
+        }
+    }
+
+    for (i = 0U; i < NUM_SYMBOLS; i++) {
+        if (ct->length[i] > max_len) {
+            return -1;
+        }
+    }
+    if (assign_canonical_codes(ct) != 0) {
+        return -1;
+    }
+    return (long)needed;
+}
+
+
+/******  *Function  : void free_huffman_tree(struct huffman_tree *tree)
+ *Description : releases a tree built by build_Tree
+ *Parameters : tree - node arena, may be NULL
+ *Effects : every node lives in the arena, so this is a single free
+ *Returned : none
+ */
+
+
+
+void free_huffman_tree(struct huffman_tree *tree){
+    free(tree);
 }
 
 
@@ -542,407 +994,2313 @@ int save_Tree(const char *filename, struct code_table *ct){
  */
 
 
+
+int encode_file(FILE*input, FILE*output, struct code_table *ct){
+    int character;
+    unsigned int i;
+    unsigned char symbol;
+
+    if (input == NULL || output == NULL || ct == NULL){
+        return -1;
+    }
+
+    rewind(input);
+
+    while ((character = fgetc(input)) != EOF) {
+        symbol = (unsigned char)character;
+
+        for (i = ct->length[symbol]; i > 0; i--) {
+            fputc('0' + (int)((ct->code[symbol] >> (i - 1)) & 1U), output);
+        }
+    }
+
+    return 0;
+}
+
+
+/* compress_sink that appends to a FILE */
+static int file_sink(void *ctx, const void *data, size_t len) {
+    return fwrite(data, 1, len, (FILE *)ctx) == len ? 0 : -1;
+}
+
+
+/******  *Function  : int compress_file(const char *input_file, const char *output_file)
+ *Description : compresses a file into the compress() container format
+ *Parameters : input_file - file to read, output_file - file to create
+ *Effects : single pass over the input in FILE_BUFFER_SIZE reads, fed to a
+ *          compress_stream; memory stays at a batch of blocks however
+ *          large the file is
+ *Returned : 0 on success and -1 on fail
+ */
+
+#define FILE_BUFFER_SIZE ((size_t)1 << 20)
+
+int compress_file(const char *input_file, const char *output_file) {
+    FILE *input, *output;
+    struct compress_options opts;
+    struct compress_stream cs;
+    uint64_t content_size = COMPRESS_SIZE_UNKNOWN;
+    char *buffer;
+    size_t got;
+    long size;
+    int result;
+
+    if (input_file == NULL || output_file == NULL) {
+        return -1;
+    }
+    input = fopen(input_file, "rb");
+    if (input == NULL) {
+        return -1;
+    }
+    if (fseek(input, 0, SEEK_END) == 0 && (size = ftell(input)) >= 0) {
+        content_size = (uint64_t)size;
+    }
+    rewind(input);
+
+    output = fopen(output_file, "wb");
+    buffer = malloc(FILE_BUFFER_SIZE);
+    compress_default_options(&opts);
+    if (output == NULL || buffer == NULL ||
+        compress_stream_init(&cs, &opts, content_size, file_sink, output) != 0) {
+        free(buffer);
+        if (output != NULL) {
+            fclose(output);
+        }
+        fclose(input);
+        return -1;
+    }
+
+    result = 0;
+    while (result == 0 && (got = fread(buffer, 1, FILE_BUFFER_SIZE, input)) > 0) {
+        result = compress_stream_write(&cs, buffer, got);
+    }
+    if (result == 0 && ferror(input)) {
+        result = -1;
+    }
+    if (result == 0) {
+        result = compress_stream_finish(&cs);
+    }
+
+    compress_stream_free(&cs);
+    free(buffer);
+    fclose(input);
+    if (fclose(output) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+
+/******  *Function  : int decompress_file(const char *input_file, const char *output_file)
+ *Description : restores a file written by compress_file
+ *Parameters : input_file - compressed file, output_file - file to create
+ *Effects : reads FILE_BUFFER_SIZE at a time through a decompress_stream, so
+ *          only one block is held in memory
+ *Returned : 0 on success and -1 on fail
+ */
+
+int decompress_file(const char *input_file, const char *output_file) {
+    FILE *input, *output;
+    struct compress_options opts;
+    struct decompress_stream ds;
+    char *buffer;
+    size_t got;
+    int result;
+
+    if (input_file == NULL || output_file == NULL) {
+        return -1;
+    }
+    input = fopen(input_file, "rb");
+    if (input == NULL) {
+        return -1;
+    }
+    output = fopen(output_file, "wb");
+    buffer = malloc(FILE_BUFFER_SIZE);
+    compress_default_options(&opts);
+    if (output == NULL || buffer == NULL ||
+        decompress_stream_init(&ds, &opts, file_sink, output) != 0) {
+        free(buffer);
+        if (output != NULL) {
+            fclose(output);
+        }
+        fclose(input);
+        return -1;
+    }
+
+    result = 0;
+    while (result == 0 && (got = fread(buffer, 1, FILE_BUFFER_SIZE, input)) > 0) {
+        result = decompress_stream_write(&ds, buffer, got);
+    }
+    if (result == 0 && ferror(input)) {
+        result = -1;
+    }
+    if (result == 0) {
+        result = decompress_stream_finish(&ds);
+    }
+
+    decompress_stream_free(&ds);
+    free(buffer);
+    fclose(input);
+    if (fclose(output) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+
+
+/******  *Function  : int save_Tree(const char *filename, struct code_table *ct)
+ *Description : saves a code table as the HUFL tag followed by its code length header
+ *Parameters : filename - file to write, ct - canonical code table
+ *Effects : creates or truncates filename
+ *Returned : 0 on success and -1 on fail
+ */
+
+
+
+int save_Tree(const char *filename, struct code_table *ct){
+    FILE *file;
+    unsigned char header[CODE_LENGTHS_MAX_SIZE];
+    size_t size;
+
+    if (filename == NULL || ct == NULL){
+        return -1;
+    }
+
+    file = fopen(filename, "wb");
+    if (file == NULL){
+        return -1;
+    }
+
+    size = write_code_lengths(ct, header);
+    if (fwrite(CODE_LENGTHS_TAG, 1, 4, file) != 4 || fwrite(header, 1, size, file) != size){
+        fclose(file);
+        return -1;
+    }
+
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+
+/******  *Function  : int load_Tree(const char*filename, struct code_table *ct)
+ *Description : loads a code table written by save_Tree
+ *Parameters : filename - file to read, ct - code table to fill
+ *Effects : the codes are rebuilt canonically from the stored lengths
+ *Returned : 0 on success and -1 on fail
+ */
+
+
  int load_Tree(const char*filename, struct code_table *ct){
 
     FILE *file;
-    unsigned int i, count;
-    char code[NUM_SYMBOLS];
-    unsigned long length;
-    unsigned char symbol;
-    char header[50];
-    char symbol_str[10];
+    unsigned char header[4 + CODE_LENGTHS_MAX_SIZE];
+    size_t size;
 
     if (filename == NULL || ct == NULL){
         return -1;
     }
 
-    file = fopen(filename, "r");
+    file = fopen(filename, "rb");
 
     if (file == NULL){
         return -1;
     }
 
-    if (fgets(header, sizeof(header), file) == NULL){
-        fclose(file);
+    size = fread(header, 1, sizeof(header), file);
+    fclose(file);
+
+    if (size < 4 || memcmp(header, CODE_LENGTHS_TAG, 4) != 0){
+        return -1;
+    }
+
+    return read_code_lengths(header + 4, size - 4, ct) < 0 ? -1 : 0;
+ }
+
+ /* Fixed-width little-endian helpers for the container header */
+static void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+
+struct bit_writer {
+    unsigned char *out;
+    size_t pos;
+    uint64_t acc;
+    unsigned int count;
+};
+
+/******  *Function  : static void bw_put(struct bit_writer *bw, uint32_t bits, unsigned int n)
+ *Description : appends the low n bits of bits to the stream, most significant bit first
+ *Parameters : bw - bit writer
+ *              bits - code bits, right aligned
+ *              n - number of bits to write, at most 32
+ *Effects : bits collect in a 64-bit accumulator and are flushed 32 at a time
+ *Returned : none
+ */
+
+static void bw_init(struct bit_writer *bw, unsigned char *out) {
+    bw->out = out;
+    bw->pos = 0;
+    bw->acc = 0;
+    bw->count = 0;
+}
+
+static void bw_put(struct bit_writer *bw, uint32_t bits, unsigned int n) {
+    bw->acc = (bw->acc << n) | bits;
+    bw->count += n;
+    if (bw->count >= 32) {
+        uint32_t word;
+        bw->count -= 32;
+        word = (uint32_t)(bw->acc >> bw->count);
+        bw->out[bw->pos++] = (unsigned char)(word >> 24);
+        bw->out[bw->pos++] = (unsigned char)(word >> 16);
+        bw->out[bw->pos++] = (unsigned char)(word >> 8);
+        bw->out[bw->pos++] = (unsigned char)word;
+    }
+}
+
+/* Write out the remaining bits, zero padding the last byte */
+static void bw_flush(struct bit_writer *bw) {
+    while (bw->count >= 8) {
+        bw->count -= 8;
+        bw->out[bw->pos++] = (unsigned char)(bw->acc >> bw->count);
+    }
+    if (bw->count > 0) {
+        bw->out[bw->pos++] = (unsigned char)(bw->acc << (8 - bw->count));
+        bw->count = 0;
+    }
+}
+
+
+struct bit_reader {
+    const unsigned char *in;
+    size_t size;
+    size_t pos;
+    uint64_t acc;
+    unsigned int count;
+};
+
+/******  *Function  : static unsigned int br_bit(struct bit_reader *br)
+ *Description : reads the next bit of a stream written by bw_put
+ *Parameters : br - bit reader
+ *Effects : refills the 64-bit accumulator a byte at a time when it runs dry;
+ *          pos keeps counting past the end so consumed bits stay exact
+ *Returned : next bit, 0 once the input is exhausted
+ */
+
+static void br_init(struct bit_reader *br, const unsigned char *in, size_t size) {
+    br->in = in;
+    br->size = size;
+    br->pos = 0;
+    br->acc = 0;
+    br->count = 0;
+}
+
+static void br_refill(struct bit_reader *br) {
+    while (br->count <= 56) {
+        br->acc <<= 8;
+        if (br->pos < br->size) {
+            br->acc |= br->in[br->pos];
+        }
+        br->pos++;
+        br->count += 8;
+    }
+}
+
+static unsigned int br_bit(struct bit_reader *br) {
+    if (br->count == 0) {
+        br_refill(br);
+    }
+    br->count--;
+    return (unsigned int)(br->acc >> br->count) & 1U;
+}
+
+
+ /* Longest code in a code table */
+static unsigned int max_code_length(const struct code_table *ct) {
+    unsigned int max_len = 0;
+    unsigned int i;
+
+    for (i = 0U; i < NUM_SYMBOLS; i++) {
+        if (ct->length[i] > max_len) {
+            max_len = ct->length[i];
+        }
+    }
+    return max_len;
+}
+
+
+/* Symbols of a payload split across its bitstreams: stream i codes a
+ * contiguous run of segment_len() symbols starting at segment_start() */
+static size_t segment_len(size_t count, unsigned int streams, unsigned int index) {
+    return count / streams + (index < count % streams ? 1 : 0);
+}
+
+static size_t segment_start(size_t count, unsigned int streams, unsigned int index) {
+    size_t extra = count % streams;
+
+    return index * (count / streams) + (index < extra ? index : extra);
+}
+
+
+/* Bits the code lengths in ct spend on the counted symbols */
+static uint64_t coded_bits(const struct frequency_table *ft, const unsigned char *lengths) {
+    uint64_t bits = 0;
+    unsigned int i;
+
+    for (i = 0; i < NUM_SYMBOLS; i++) {
+        bits += (uint64_t)ft->freq[i] * lengths[i];
+    }
+    return bits;
+}
+
+/* log2(x) in 16.16 fixed point, read off the chord between powers of two;
+ * it is low by at most LOG2_CHORD_ERROR */
+#define LOG2_CHORD_ERROR 5645u
+
+static uint64_t log2_chord(uint64_t x) {
+    unsigned int top = 0;
+
+#if defined(__GNUC__)
+    top = 63 - (unsigned int)__builtin_clzll(x);
+#else
+    while (x >> top > 1) {
+        top++;
+    }
+#endif
+
+    return ((uint64_t)top << 16) + (((x - ((uint64_t)1 << top)) << 16) >> top);
+}
+
+/* Fewest bytes a built table can take: the smaller header form for this
+ * many symbols, plus the order-0 entropy, which no prefix code beats */
+static uint64_t dynamic_size_floor(const struct frequency_table *ft, size_t input_len) {
+    uint64_t log_total, entropy = 0;
+    unsigned int count = 0;
+    unsigned int i;
+
+    if (input_len == 0) {
+        return 0;
+    }
+    log_total = log2_chord(input_len);
+    for (i = 0; i < NUM_SYMBOLS; i++) {
+        uint64_t log_symbol;
+
+        if (ft->freq[i] == 0) {
+            continue;
+        }
+        count++;
+        log_symbol = log2_chord(ft->freq[i]) + LOG2_CHORD_ERROR;
+        if (log_symbol < log_total) {
+            entropy += ft->freq[i] * (log_total - log_symbol);
+        }
+    }
+    return 2 + (2 * count < NUM_SYMBOLS / 2 ? 2 * count : NUM_SYMBOLS / 2) + (entropy >> 16) / 8;
+}
+
+
+/******  *Function  : static int plan_huffman(const unsigned char *input, size_t input_len, unsigned int max_code_len, unsigned int streams, unsigned int threads, struct huffman_plan *plan)
+ *Description : picks the code table for one block and works out its exact coded size
+ *Parameters : input - block data, input_len - bytes in the block
+ *              max_code_len - code length cap (0 = HUFFMAN_MAX_BITS)
+ *              streams - 1 or HUFFMAN_STREAMS bitstreams
+ *              threads - threads for counting
+ *              plan - receives the code lengths, packed codes and payload size
+ *Effects : the payload write_huffman produces is [code lengths], one bit
+ *          count (u32) per stream as the jump table, then each stream's
+ *          packed bits starting on a byte boundary. The built-in table is
+ *          used when it codes the block smaller than a table built for it;
+ *          when no built table could beat it, no tree is built at all
+ *Returned : 0 on success, -1 on failure
+ */
+
+struct huffman_plan {
+    unsigned char header[CODE_LENGTHS_MAX_SIZE];
+    size_t header_size;
+    struct code_table codes;
+    unsigned int streams;
+    uint64_t stream_bits[HUFFMAN_STREAMS];
+    size_t size;
+};
+
+static int plan_huffman(const unsigned char *input, size_t input_len, unsigned int max_code_len,
+                        unsigned int streams, unsigned int threads, struct huffman_plan *plan) {
+    struct frequency_table ft;
+    struct code_table *ct = &plan->codes;
+    struct huffman_tree *tree;
+    unsigned int max_len;
+    uint64_t static_size = UINT64_MAX;
+    unsigned int s;
+    
+    // Step 1: Build frequency table
+    initialise_Frequency(&ft);
+    if (count_frequencies_parallel(input, input_len, threads, &ft) != 0) {
         return -1;
     }
+    
+    // Step 2: Cost the built-in table; if nothing built could be smaller, take it
+    max_len = max_code_len > 0 && max_code_len < HUFFMAN_MAX_BITS ? max_code_len : HUFFMAN_MAX_BITS;
+    if (max_len >= STATIC_TABLE_MAX_BITS) {
+        static_size = 1 + (coded_bits(&ft, static_code_lengths) + 7) / 8;
+    }
+    if (static_size <= dynamic_size_floor(&ft, input_len)) {
+        if (static_code_table(ct) != 0) {
+            return -1;
+        }
+        plan->header[0] = CODE_LENGTHS_STATIC;
+        plan->header_size = 1;
+    } else {
+        // Step 3: Build Huffman tree
+        if (build_Tree(&ft, &tree) != 0) {
+            return -1;
+        }
+        
+        // Step 4: Code lengths from the tree, redone with package-merge if too deep
+        if (tree_code_lengths(tree, ct) != 0) {
+            free_huffman_tree(tree);
+            return -1;
+        }
+        free_huffman_tree(tree);
+        if (max_code_length(ct) > max_len) {
+            if (generate_limited_encoding(&ft, max_len, ct) != 0) {
+                return -1;
+            }
+        } else if (assign_canonical_codes(ct) != 0) {
+            return -1;
+        }
+        
+        // Step 5: Only the code lengths go in the header, unless the built-in table wins
+        plan->header_size = write_code_lengths(ct, plan->header);
+        if (static_size < plan->header_size + (coded_bits(&ft, ct->length) + 7) / 8) {
+            if (static_code_table(ct) != 0) {
+                return -1;
+            }
+            plan->header[0] = CODE_LENGTHS_STATIC;
+            plan->header_size = 1;
+        }
+    }
+    
+    // Step 6: Size each stream; a single stream needs no second pass
+    plan->streams = streams;
+    plan->size = plan->header_size;
+    for (s = 0; s < streams; s++) {
+        size_t start = segment_start(input_len, streams, s);
+        size_t end = start + segment_len(input_len, streams, s);
+        uint64_t bits = 0;
+
+        if (streams == 1) {
+            bits = coded_bits(&ft, ct->length);
+        } else {
+            size_t i;
+            for (i = start; i < end; i++) {
+                bits += ct->length[input[i]];
+            }
+        }
+        if (bits > UINT32_MAX) {
+            return -1;
+        }
+        plan->stream_bits[s] = bits;
+        plan->size += 4 + (size_t)((bits + 7) / 8);
+    }
+    return 0;
+}
+
+
+/******  *Function  : static void write_huffman(const struct huffman_plan *plan, const unsigned char *input, size_t input_len, unsigned char *out)
+ *Description : writes a planned Huffman payload
+ *Parameters : plan - from plan_huffman, input - the data planned, input_len - its size
+ *              out - receives plan->size bytes
+ *Effects :
+ *Returned : none
+ */
+
+static void write_huffman(const struct huffman_plan *plan, const unsigned char *input,
+                          size_t input_len, unsigned char *out) {
+    struct bit_writer bw;
+    unsigned char *stream;
+    unsigned int s;
+    size_t i;
+
+    memcpy(out, plan->header, plan->header_size);
+    stream = out + plan->header_size + 4 * plan->streams;
+    for (s = 0; s < plan->streams; s++) {
+        size_t start = segment_start(input_len, plan->streams, s);
+        size_t end = start + segment_len(input_len, plan->streams, s);
+
+        put_u32(out + plan->header_size + 4 * s, (uint32_t)plan->stream_bits[s]);
+        bw_init(&bw, stream);
+        for (i = start; i < end; i++) {
+            unsigned char symbol = input[i];
+            bw_put(&bw, plan->codes.code[symbol], plan->codes.length[symbol]);
+        }
+        bw_flush(&bw);
+        stream += (plan->stream_bits[s] + 7) / 8;
+    }
+}
+
+
+/* The three token streams of an LZ block, in payload order; blocks
+ * shorter than LZ_MIN_BLOCK are not worth parsing, and blocks shorter than
+ * MULTI_STREAM_MIN_BLOCK are not worth the jump table */
+#define LZ_STREAMS             3
+#define LZ_MIN_BLOCK           64
+#define MULTI_STREAM_MIN_BLOCK 1024
+
+static void lz_stream(const struct lz_sequences *seq, unsigned int index,
+                      const unsigned char **data, size_t *size) {
+    if (index == 0) {
+        *data = seq->literals;
+        *size = seq->literal_count;
+    } else if (index == 1) {
+        *data = seq->lengths;
+        *size = seq->lengths_size;
+    } else {
+        *data = seq->distances;
+        *size = seq->distances_size;
+    }
+}
+
+/* One entropy coded payload: a Huffman plan written out later, or a tANS
+ * payload already coded while planning */
+struct entropy_plan {
+    struct huffman_plan huffman;
+    unsigned char *ans;
+    size_t size;
+};
+
+static int plan_entropy(const unsigned char *input, size_t input_len, enum entropy_codec codec,
+                        unsigned int max_code_len, unsigned int streams, unsigned int threads,
+                        struct entropy_plan *plan) {
+    plan->ans = NULL;
+    if (codec == CODEC_ANS) {
+        plan->ans = ans_encode(input, input_len, &plan->size);
+        return plan->ans ? 0 : -1;
+    }
+    if (plan_huffman(input, input_len, max_code_len, streams, threads, &plan->huffman) != 0) {
+        return -1;
+    }
+    plan->size = plan->huffman.size;
+    return 0;
+}
+
+static void write_entropy(const struct entropy_plan *plan, const unsigned char *input,
+                          size_t input_len, unsigned char *out) {
+    if (plan->ans) {
+        memcpy(out, plan->ans, plan->size);
+    } else {
+        write_huffman(&plan->huffman, input, input_len, out);
+    }
+}
+
+static void free_entropy(struct entropy_plan *plan) {
+    free(plan->ans);
+    plan->ans = NULL;
+}
+
+/* A planned block: plain entropy coding, or LZ77 sequences whose streams
+ * are each entropy coded, whichever came out smaller; or the block as it
+ * is, or as one repeated byte */
+struct block_plan {
+    unsigned char type;
+    unsigned char flags;
+    struct entropy_plan plain;
+    struct lz_sequences lz;
+    struct entropy_plan streams[LZ_STREAMS];
+    size_t size;
+};
+
+static void free_block_plan(struct block_plan *plan) {
+    unsigned int i;
+
+    free_entropy(&plan->plain);
+    for (i = 0; i < LZ_STREAMS; i++) {
+        free_entropy(&plan->streams[i]);
+    }
+    lz_free(&plan->lz);
+}
+
+/* Entropy codes the block, through LZ77 when that comes out smaller */
+static int plan_coded_block(const char *input, size_t input_len, const struct compress_options *opts,
+                            unsigned int threads, struct block_plan *plan) {
+    enum entropy_codec codec = opts->codec;
+    const unsigned char *data;
+    size_t data_size;
+    size_t lz_size;
+    unsigned int streams = 1;
+    unsigned int i;
+
+    if (opts->streams == HUFFMAN_STREAMS && input_len >= MULTI_STREAM_MIN_BLOCK &&
+        codec == CODEC_HUFFMAN) {
+        streams = HUFFMAN_STREAMS;
+    }
+    if (plan_entropy((const unsigned char *)input, input_len, codec, opts->max_code_len, streams,
+                     threads, &plan->plain) != 0) {
+        return -1;
+    }
+    plan->type = BLOCK_HUFFMAN;
+    if (codec == CODEC_ANS) {
+        plan->flags = BLOCK_ANS;
+    } else if (streams > 1) {
+        plan->flags = BLOCK_MULTI_STREAM;
+    }
+    plan->size = 1 + plan->plain.size;
+    if (opts->level == 0 || input_len < LZ_MIN_BLOCK) {
+        return 0;
+    }
+    
+    // Try the LZ77 stage and keep it only if it wins
+    if (lz_parse((const unsigned char *)input, input_len, opts->level, &plan->lz) != 0) {
+        return -1;
+    }
+    lz_size = 1 + 4;
+    for (i = 0; i < LZ_STREAMS; i++) {
+        lz_stream(&plan->lz, i, &data, &data_size);
+        if (data_size > 0 && plan_entropy(data, data_size, codec, opts->max_code_len, streams, 1,
+                                          &plan->streams[i]) != 0) {
+            return -1;
+        }
+        lz_size += FRAME_HEADER_SIZE + plan->streams[i].size;
+    }
+    if (lz_size < plan->size) {
+        plan->type = BLOCK_LZ;
+        plan->size = lz_size;
+        free_entropy(&plan->plain);
+    } else {
+        for (i = 0; i < LZ_STREAMS; i++) {
+            free_entropy(&plan->streams[i]);
+        }
+        lz_free(&plan->lz);
+    }
+    return 0;
+}
+
+
+/******  *Function  : static int plan_block(const char *input, size_t input_len, const struct compress_options *opts, unsigned int threads, struct block_plan *plan)
+ *Description : chooses the coding of one block and works out its exact size
+ *Parameters : input - block data, input_len - bytes in the block
+ *              opts - compression settings, threads - threads for counting
+ *              plan - receives the plan; release it with free_block_plan()
+ *Effects : payload is [type][entropy payload], or for BLOCK_LZ
+ *          [type][sequence count (u32)] and for each of the literal, length
+ *          and distance streams [raw size (u32)][payload size (u32)][entropy payload].
+ *          BLOCK_MULTI_STREAM in the type means every Huffman payload of
+ *          the block has HUFFMAN_STREAMS bitstreams; BLOCK_ANS means every
+ *          payload is tANS. A block of one repeated byte is [BLOCK_RLE][byte]
+ *          and one that codes no smaller than it is goes out as
+ *          [BLOCK_STORED][raw bytes], so no payload exceeds 1 + input_len
+ *Returned : 0 on success, -1 on failure
+ */
+
+static int plan_block(const char *input, size_t input_len, const struct compress_options *opts,
+                      unsigned int threads, struct block_plan *plan) {
+    size_t i;
+
+    memset(plan, 0, sizeof(*plan));
+    for (i = 1; i < input_len && input[i] == input[0]; i++) {
+    }
+    if (input_len > 0 && i == input_len) {
+        plan->type = BLOCK_RLE;
+        plan->size = 2;
+        return 0;
+    }
+    if (plan_coded_block(input, input_len, opts, threads, plan) != 0) {
+        free_block_plan(plan);
+        return -1;
+    }
+    if (plan->size >= 1 + input_len) {
+        free_block_plan(plan);
+        plan->type = BLOCK_STORED;
+        plan->flags = 0;
+        plan->size = 1 + input_len;
+    }
+    return 0;
+}
+
+
+/******  *Function  : static void write_block(const struct block_plan *plan, const char *input, size_t input_len, unsigned char *out)
+ *Description : writes the payload of a planned block
+ *Parameters : plan - from plan_block, input - block data, input_len - its size
+ *              out - receives plan->size bytes
+ *Effects :
+ *Returned : none
+ */
+
+static void write_block(const struct block_plan *plan, const char *input, size_t input_len,
+                        unsigned char *out) {
+    const unsigned char *data;
+    size_t data_size;
+    unsigned int i;
+
+    out[0] = plan->type | plan->flags;
+    if (plan->type == BLOCK_STORED) {
+        memcpy(out + 1, input, input_len);
+        return;
+    }
+    if (plan->type == BLOCK_RLE) {
+        out[1] = (unsigned char)input[0];
+        return;
+    }
+    if (plan->type == BLOCK_HUFFMAN) {
+        write_entropy(&plan->plain, (const unsigned char *)input, input_len, out + 1);
+        return;
+    }
+    put_u32(out + 1, (uint32_t)plan->lz.sequence_count);
+    out += 1 + 4;
+    for (i = 0; i < LZ_STREAMS; i++) {
+        lz_stream(&plan->lz, i, &data, &data_size);
+        put_u32(out, (uint32_t)data_size);
+        put_u32(out + 4, (uint32_t)plan->streams[i].size);
+        if (data_size > 0) {
+            write_entropy(&plan->streams[i], data, data_size, out + FRAME_HEADER_SIZE);
+        }
+        out += FRAME_HEADER_SIZE + plan->streams[i].size;
+    }
+}
+
+
+/* Shared state for compressing the blocks of one input on several threads.
+ * Every block is planned first, so each frame's offset is known before any
+ * thread writes its payload straight into the output. */
+struct block_job {
+    const char *input;
+    size_t input_len;
+    size_t block_size;
+    size_t block_count;
+    const struct compress_options *opts;
+    unsigned int count_threads;
+    struct block_plan *plans;
+    int *status;
+    size_t *offsets;
+    size_t frames_size;
+    unsigned char *output;
+};
+
+static size_t job_block_len(const struct block_job *job, size_t index) {
+    size_t len = job->input_len - index * job->block_size;
+
+    return len > job->block_size ? job->block_size : len;
+}
+
+static void plan_block_task(void *ctx, size_t index) {
+    struct block_job *job = (struct block_job *)ctx;
+
+    job->status[index] = plan_block(job->input + index * job->block_size, job_block_len(job, index),
+                                    job->opts, job->count_threads, &job->plans[index]);
+}
+
+static void write_block_task(void *ctx, size_t index) {
+    struct block_job *job = (struct block_job *)ctx;
+    unsigned char *frame = job->output + job->offsets[index];
+    size_t len = job_block_len(job, index);
+
+    put_u32(frame, (uint32_t)len);
+    put_u32(frame + 4, (uint32_t)job->plans[index].size);
+    write_block(&job->plans[index], job->input + index * job->block_size, len,
+                frame + FRAME_HEADER_SIZE);
+}
+
+/* Largest payload a block of raw_len bytes can have; anything bigger would
+ * have been stored */
+static size_t block_bound(size_t raw_len) {
+    return 1 + raw_len;
+}
+
+/* Block size from the options, kept inside what the frame fields can hold */
+static size_t effective_block_size(const struct compress_options *opts) {
+    if (opts->block_size == 0 || opts->block_size > COMPRESS_MAX_BLOCK) {
+        return COMPRESS_MAX_BLOCK;
+    }
+    return opts->block_size;
+}
+
+/* Plans every block of the input in parallel and lays out the frames;
+ * job->frames_size is then the size of all frames, end frame excluded */
+static int plan_blocks(struct block_job *job, const char *input, size_t input_len,
+                       const struct compress_options *opts) {
+    size_t slots;
+    size_t offset = 0;
+    size_t i;
+
+    job->input = input;
+    job->input_len = input_len;
+    job->block_size = effective_block_size(opts);
+    job->block_count = (input_len + job->block_size - 1) / job->block_size;
+    job->opts = opts;
+    /* one big block gets the threads for counting instead */
+    job->count_threads = job->block_count == 1 ? opts->threads : 1;
+    job->frames_size = 0;
+    job->output = NULL;
+    slots = job->block_count ? job->block_count : 1;
+    job->plans = calloc(slots, sizeof(*job->plans));
+    job->status = calloc(slots, sizeof(*job->status));
+    job->offsets = malloc(slots * sizeof(*job->offsets));
+    if (!job->plans || !job->status || !job->offsets ||
+        parallel_for(job->block_count, opts->threads, plan_block_task, job) != 0) {
+        return -1;
+    }
+    for (i = 0; i < job->block_count; i++) {
+        if (job->status[i] != 0) {
+            return -1;
+        }
+        job->offsets[i] = offset;
+        offset += FRAME_HEADER_SIZE + job->plans[i].size;
+    }
+    job->frames_size = offset;
+    return 0;
+}
+
+/* Writes the planned frames, in parallel, to output (job->frames_size bytes) */
+static int write_blocks(struct block_job *job, unsigned char *output) {
+    job->output = output;
+    return parallel_for(job->block_count, job->opts->threads, write_block_task, job);
+}
+
+static void free_block_job(struct block_job *job) {
+    size_t i;
+
+    for (i = 0; job->plans && i < job->block_count; i++) {
+        free_block_plan(&job->plans[i]);
+    }
+    free(job->plans);
+    free(job->status);
+    free(job->offsets);
+}
+
+ /* Container header: magic, version and content size */
+static void write_container_header(unsigned char *out, uint64_t content_size) {
+    memcpy(out, COMPRESS_MAGIC, 4);
+    out[4] = COMPRESS_VERSION;
+    put_u64(out + 5, content_size);
+}
+
+/* Writes the whole container for a planned job; out holds total_size bytes */
+static int write_container(struct block_job *job, unsigned char *out) {
+    write_container_header(out, (uint64_t)job->input_len);
+    if (write_blocks(job, out + COMPRESS_HEADER_SIZE) != 0) {
+        return -1;
+    }
+    memset(out + COMPRESS_HEADER_SIZE + job->frames_size, 0, FRAME_HEADER_SIZE);
+    return 0;
+}
+
+
+/******  *Function  : size_t compress_bound(size_t inputSize)
+ *Description : worst case compressed size of inputSize bytes at the default block size
+ *Parameters : inputSize - input length
+ *Effects : a block that does not shrink is stored, so each block grows
+ *          by at most its frame header and type byte
+ *Returned : byte count, or 0 if it does not fit in a size_t
+ */
+
+size_t compress_bound(size_t inputSize) {
+    size_t blocks = inputSize / COMPRESS_BLOCK_SIZE + 1;
+    size_t overhead = COMPRESS_HEADER_SIZE + FRAME_HEADER_SIZE +
+                      blocks * (FRAME_HEADER_SIZE + 1);
+
+    if (inputSize > SIZE_MAX - overhead) {
+        return 0;
+    }
+    return inputSize + overhead;
+}
+
+
+/******  *Function  : int compress_buffer(const void* input, size_t inputSize, void* output, size_t outputCapacity, size_t* outputSize, const struct compress_options *opts)
+ *Description : compresses inputSize bytes of any content into a caller's buffer
+ *Parameters : input, inputSize - data to compress, NUL bytes included
+ *              output, outputCapacity - destination buffer
+ *              outputSize - receives the compressed size, or the size needed
+ *              when output is too small
+ *              opts - settings (NULL for defaults)
+ *Effects : blocks are written straight into output, with no staging copy
+ *Returned : 0 on success, -1 on failure or if output is too small
+ */
+
+int compress_buffer(const void* input, size_t inputSize, void* output, size_t outputCapacity,
+                    size_t* outputSize, const struct compress_options *opts) {
+    struct compress_options defaults;
+    struct block_job job;
+    size_t total_size;
+    int result = -1;
+
+    if ((!input && inputSize > 0) || !outputSize) {
+        return -1;
+    }
+    if (!opts) {
+        compress_default_options(&defaults);
+        opts = &defaults;
+    }
+    
+    if (plan_blocks(&job, (const char *)input, inputSize, opts) == 0) {
+        total_size = COMPRESS_HEADER_SIZE + job.frames_size + FRAME_HEADER_SIZE;
+        *outputSize = total_size;
+        if (output && total_size <= outputCapacity) {
+            result = write_container(&job, (unsigned char *)output);
+        }
+    }
+    free_block_job(&job);
+    return result;
+}
+
+
+/******  *Function  : char* compress_data(const void* input, size_t inputSize, size_t* outputSize, const struct compress_options *opts)
+ *Description : compresses inputSize bytes of any content into a new buffer
+ *Parameters : input, inputSize - data to compress, NUL bytes included
+ *              outputSize - receives the compressed size
+ *              opts - settings (NULL for defaults)
+ *Effects : the buffer is allocated once, at its exact final size
+ *Returned : malloc'd compressed data, or NULL on failure
+ */
+
+char* compress_data(const void* input, size_t inputSize, size_t* outputSize,
+                    const struct compress_options *opts) {
+    struct compress_options defaults;
+    struct block_job job;
+    unsigned char *final_output = NULL;
+    size_t total_size = 0;
+
+    if ((!input && inputSize > 0) || !outputSize) {
+        return NULL;
+    }
+    if (!opts) {
+        compress_default_options(&defaults);
+        opts = &defaults;
+    }
+    
+    if (plan_blocks(&job, (const char *)input, inputSize, opts) == 0) {
+        total_size = COMPRESS_HEADER_SIZE + job.frames_size + FRAME_HEADER_SIZE;
+        final_output = malloc(total_size);
+        if (final_output && write_container(&job, final_output) != 0) {
+            free(final_output);
+            final_output = NULL;
+        }
+    }
+    free_block_job(&job);
+    
+    if (!final_output) {
+        return NULL;
+    }
+    *outputSize = total_size;
+    return (char *)final_output;
+}
+
+ // New function - works with memory buffers
+char* compress(const char* input, size_t* outputSize) {
+    struct compress_options opts;
+
+    compress_default_options(&opts);
+    return compress_with_options(input, outputSize, &opts);
+}
+
+/* NUL-terminated front end to compress_data(), kept for text callers */
+char* compress_with_options(const char* input, size_t* outputSize,
+                            const struct compress_options *opts) {
+    if (!input || !outputSize || !opts) {
+        return NULL;
+    }
+    
+    size_t input_len = strlen(input);
+    if (input_len == 0) {
+        *outputSize = 0;
+        return NULL;
+    }
+    return compress_data(input, input_len, outputSize, opts);
+}
+
+
+static uint64_t get_be64(const unsigned char *p) {
+    uint64_t v = 0;
+    unsigned int i;
+
+    for (i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/* Top up the accumulator so that at least 57 bits are available, taking
+ * whole bytes from one 8-byte load while the input lasts; past the end of
+ * the input the stream reads as zero bits */
+static void br_refill_fast(struct bit_reader *br) {
+    if (br->count <= 56) {
+        if (br->size >= 8 && br->pos <= br->size - 8) {
+            unsigned int bytes = (64 - br->count) >> 3;
+            uint64_t word = get_be64(br->in + br->pos);
+
+            br->acc = bytes == 8 ? word : (br->acc << (bytes * 8)) | (word >> (64 - bytes * 8));
+            br->pos += bytes;
+            br->count += bytes * 8;
+        } else {
+            br_refill(br);
+        }
+    }
+}
+
+static unsigned int br_peek(const struct bit_reader *br, unsigned int n) {
+    return (unsigned int)(br->acc >> (br->count - n)) & ((1U << n) - 1U);
+}
+
+/* Number of bits handed out so far */
+static uint64_t br_consumed(const struct bit_reader *br) {
+    return (uint64_t)br->pos * 8 - br->count;
+}
+
+
+/******  *Function  : static int build_decode_table(const struct code_table *ct, struct decode_table *dt)
+ *Description : builds the lookup tables used by the table decoder
+ *Parameters : ct - code table read from the compressed header
+ *              dt - decode table to fill
+ *Effects : every code of at most DECODE_TABLE_BITS bits fills all primary
+ *          slots that start with it; longer codes go into a binary trie
+ *          that the decoder walks bit by bit
+ *Returned : 0 on success, -1 if the code table is not a prefix code
+ */
+
+#define DECODE_TABLE_BITS  11
+#define DECODE_TABLE_SIZE  (1U << DECODE_TABLE_BITS)
+#define DECODE_TRIE_MAX    (NUM_SYMBOLS * HUFFMAN_MAX_BITS)
+
+struct decode_table {
+    /* symbol in the low byte, code length above it; 0 means "walk the trie" */
+    uint16_t primary[DECODE_TABLE_SIZE];
+    /* for DECODE_MULTI: up to DECODE_MULTI_SYMBOLS symbols in the low bytes,
+     * their total code length in bits 24-27 and their count above; 0 means
+     * no code fits */
+    uint32_t multi[DECODE_TABLE_SIZE];
+    /* child links of the trie for long codes: > 0 is a node index,
+     * < 0 is ~symbol, 0 is an unused branch */
+    int32_t (*trie)[2];
+    unsigned int trie_size;
+};
+
+static int trie_insert(struct decode_table *dt, uint32_t code, unsigned int length, unsigned int symbol) {
+    int32_t node = 0;
+    unsigned int i;
+
+    for (i = 0; i < length; i++) {
+        int bit = (int)((code >> (length - 1 - i)) & 1U);
+        int32_t next = dt->trie[node][bit];
+
+        if (i + 1 == length) {
+            if (next != 0) {
+                return -1;
+            }
+            dt->trie[node][bit] = ~(int32_t)symbol;
+            return 0;
+        }
+        if (next < 0) {
+            return -1;
+        }
+        if (next == 0) {
+            if (dt->trie_size >= DECODE_TRIE_MAX) {
+                return -1;
+            }
+            next = (int32_t)dt->trie_size++;
+            dt->trie[next][0] = 0;
+            dt->trie[next][1] = 0;
+            dt->trie[node][bit] = next;
+        }
+        node = next;
+    }
+    return -1;
+}
+
+static int build_decode_table(const struct code_table *ct, struct decode_table *dt) {
+    unsigned int symbol;
+
+    memset(dt->primary, 0, sizeof(dt->primary));
+    dt->trie = NULL;
+    dt->trie_size = 1;
+
+    for (symbol = 0; symbol < NUM_SYMBOLS; symbol++) {
+        unsigned int length = ct->length[symbol];
+        unsigned int prefix;
+        unsigned int j, fill;
+
+        if (length == 0) {
+            continue;
+        }
+        if (length > HUFFMAN_MAX_BITS) {
+            return -1;
+        }
+        if (length > DECODE_TABLE_BITS) {
+            if (dt->trie == NULL) {
+                dt->trie = calloc(DECODE_TRIE_MAX, sizeof(*dt->trie));
+                if (dt->trie == NULL) {
+                    return -1;
+                }
+            }
+            if (trie_insert(dt, ct->code[symbol], length, symbol) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        fill = 1U << (DECODE_TABLE_BITS - length);
+        prefix = (unsigned int)ct->code[symbol] << (DECODE_TABLE_BITS - length);
+        for (j = 0; j < fill; j++) {
+            if (dt->primary[prefix + j] != 0) {
+                return -1;
+            }
+            dt->primary[prefix + j] = (uint16_t)(symbol | (length << 8));
+        }
+    }
+    return 0;
+}
+
+/* Most symbols one DECODE_MULTI probe can give */
+#define DECODE_MULTI_SYMBOLS 3
+
+/* Fills dt->multi from dt->primary: each window takes the codes that lie
+ * wholly inside it, one after another, up to DECODE_MULTI_SYMBOLS */
+static void build_multi_table(struct decode_table *dt) {
+    unsigned int window;
+
+    for (window = 0; window < DECODE_TABLE_SIZE; window++) {
+        uint32_t entry = dt->primary[window];
+        uint32_t symbols, length, count = 1;
+
+        if (entry == 0) {
+            dt->multi[window] = 0;
+            continue;
+        }
+        symbols = entry & 0xFF;
+        length = entry >> 8;
+        while (count < DECODE_MULTI_SYMBOLS) {
+            entry = dt->primary[(window << length) & (DECODE_TABLE_SIZE - 1)];
+            if (entry == 0 || length + (entry >> 8) > DECODE_TABLE_BITS) {
+                break;
+            }
+            symbols |= (entry & 0xFF) << (8 * count);
+            length += entry >> 8;
+            count++;
+        }
+        dt->multi[window] = symbols | (length << 24) | (count << 28);
+    }
+}
+
+static void free_decode_table(struct decode_table *dt) {
+    free(dt->trie);
+    dt->trie = NULL;
+}
+
+
+/* Decodes one symbol into *out: a primary table probe, or the trie for
+ * codes longer than the peek window. Returns 0, or -1 on an invalid code */
+static int decode_symbol(const struct decode_table *dt, struct bit_reader *br, char *out) {
+    uint16_t entry;
+    int32_t node = 0;
+
+    br_refill_fast(br);
+    entry = dt->primary[br_peek(br, DECODE_TABLE_BITS)];
+    if (entry != 0) {
+        *out = (char)(entry & 0xFF);
+        br->count -= entry >> 8;
+        return 0;
+    }
+
+    /* long code or invalid prefix: walk the trie from the root */
+    if (dt->trie == NULL) {
+        return -1;
+    }
+    do {
+        node = dt->trie[node][br_bit(br)];
+    } while (node > 0);
+    if (node == 0) {
+        return -1;
+    }
+    *out = (char)(unsigned char)~node;
+    return 0;
+}
+
+
+/******  *Function  : static int decode_table_driven(...)
+ *Description : decodes original_len symbols by peeking DECODE_TABLE_BITS bits
+ *              and resolving symbol and length with one primary table probe
+ *Parameters : dt - decode table, br - bit reader positioned at the payload
+ *              out - output buffer of at least original_len bytes
+ *Effects : codes longer than the peek window fall back to the trie
+ *Returned : 0 on success, -1 on an invalid code
+ */
+
+static int decode_table_driven(const struct decode_table *dt, struct bit_reader *br,
+                               char *out, size_t original_len) {
+    size_t i;
+
+    for (i = 0; i < original_len; i++) {
+        if (decode_symbol(dt, br, &out[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/******  *Function  : static int decode_interleaved(...)
+ *Description : decodes the HUFFMAN_STREAMS bitstreams of a payload together,
+ *              one symbol from each stream per step
+ *Parameters : dt - decode table, br - one bit reader per stream
+ *              out - output buffer of original_len bytes
+ *Effects : the streams are independent, so their table lookups overlap
+ *          instead of each waiting on the previous code length. When no
+ *          code is longer than the peek window, one refill is good for
+ *          DECODE_FAST_SYMBOLS symbols of every stream.
+ *Returned : 0 on success, -1 on an invalid code
+ */
+
+#define DECODE_FAST_SYMBOLS (57 / DECODE_TABLE_BITS)
+
+static int decode_interleaved(const struct decode_table *dt, struct bit_reader *br,
+                              char *out, size_t original_len) {
+    char *dst[HUFFMAN_STREAMS];
+    size_t common = original_len / HUFFMAN_STREAMS;
+    size_t i = 0;
+    unsigned int s, k;
+
+    for (s = 0; s < HUFFMAN_STREAMS; s++) {
+        dst[s] = out + segment_start(original_len, HUFFMAN_STREAMS, s);
+    }
+    if (dt->trie == NULL) {
+        for (; i + DECODE_FAST_SYMBOLS <= common; i += DECODE_FAST_SYMBOLS) {
+            for (s = 0; s < HUFFMAN_STREAMS; s++) {
+                br_refill_fast(&br[s]);
+            }
+            for (k = 0; k < DECODE_FAST_SYMBOLS; k++) {
+                for (s = 0; s < HUFFMAN_STREAMS; s++) {
+                    uint16_t entry = dt->primary[br_peek(&br[s], DECODE_TABLE_BITS)];
+                    if (entry == 0) {
+                        return -1;
+                    }
+                    dst[s][i + k] = (char)(entry & 0xFF);
+                    br[s].count -= entry >> 8;
+                }
+            }
+        }
+    }
+    for (; i < common; i++) {
+        if (decode_symbol(dt, &br[0], &dst[0][i]) != 0 ||
+            decode_symbol(dt, &br[1], &dst[1][i]) != 0 ||
+            decode_symbol(dt, &br[2], &dst[2][i]) != 0 ||
+            decode_symbol(dt, &br[3], &dst[3][i]) != 0) {
+            return -1;
+        }
+    }
+    /* the first original_len % HUFFMAN_STREAMS streams hold one more */
+    for (s = 0; s < original_len % HUFFMAN_STREAMS; s++) {
+        if (decode_symbol(dt, &br[s], &dst[s][common]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/******  *Function  : static int decode_multi(const struct decode_table *dt, struct bit_reader *br, char *out, size_t original_len, unsigned int streams)
+ *Description : decodes the bitstreams of a payload with the multi-symbol table
+ *Parameters : dt - decode table with no trie, br - one bit reader per stream
+ *              out - output buffer of original_len bytes, streams - 1 or HUFFMAN_STREAMS
+ *Effects : each probe stores DECODE_MULTI_SYMBOLS bytes and keeps as many as
+ *          it decoded, so the streams run this way only while every one has
+ *          room for a full refill's worth; the rest goes a symbol at a time
+ *Returned : 0 on success, -1 on an invalid code
+ */
+
+#define DECODE_MULTI_MARGIN (DECODE_FAST_SYMBOLS * DECODE_MULTI_SYMBOLS)
+/* below this many symbols building the table costs more than it saves */
+#define DECODE_MULTI_MIN    DECODE_TABLE_SIZE
+
+static int decode_multi(const struct decode_table *dt, struct bit_reader *br,
+                        char *out, size_t original_len, unsigned int streams) {
+    char *dst[HUFFMAN_STREAMS];
+    char *end[HUFFMAN_STREAMS];
+    unsigned int s, k;
+
+    for (s = 0; s < streams; s++) {
+        dst[s] = out + segment_start(original_len, streams, s);
+        end[s] = dst[s] + segment_len(original_len, streams, s);
+    }
+    for (;;) {
+        for (s = 0; s < streams && end[s] - dst[s] >= DECODE_MULTI_MARGIN; s++) {
+        }
+        if (s < streams) {
+            break;
+        }
+        for (s = 0; s < streams; s++) {
+            br_refill_fast(&br[s]);
+        }
+        for (k = 0; k < DECODE_FAST_SYMBOLS; k++) {
+            for (s = 0; s < streams; s++) {
+                uint32_t entry = dt->multi[br_peek(&br[s], DECODE_TABLE_BITS)];
+                if (entry == 0) {
+                    return -1;
+                }
+                dst[s][0] = (char)entry;
+                dst[s][1] = (char)(entry >> 8);
+                dst[s][2] = (char)(entry >> 16);
+                dst[s] += entry >> 28;
+                br[s].count -= (entry >> 24) & 0x0F;
+            }
+        }
+    }
+    for (s = 0; s < streams; s++) {
+        while (dst[s] < end[s]) {
+            if (decode_symbol(dt, &br[s], dst[s]++) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/******  *Function  : static int decode_scan(...)
+ *Description : original decoder, grows the current code a bit at a time and
+ *              compares it against every entry of the code table
+ *Parameters : ct - code table, br - bit reader positioned at the payload
+ *              bits_size - payload bit count, out - output buffer
+ *Effects : kept as DECODE_SCAN for benchmarking the table decoder
+ *Returned : number of symbols decoded
+ */
+
+static size_t decode_scan(const struct code_table *ct, struct bit_reader *br, uint64_t bits_size,
+                          char *out, size_t original_len) {
+    uint32_t current_code = 0;
+    unsigned int code_pos = 0;
+    size_t output_size = 0;
+    
+    for (uint64_t i = 0; i < bits_size && output_size < original_len; i++) {
+        if (code_pos >= HUFFMAN_MAX_BITS) {
+            break;
+        }
+        current_code = (current_code << 1) | br_bit(br);
+        code_pos++;
+        
+        // Check if current_code matches any symbol's code
+        for (unsigned int symbol = 0; symbol < NUM_SYMBOLS; symbol++) {
+            if (ct->length[symbol] == code_pos && ct->code[symbol] == current_code) {
+                out[output_size++] = (char)symbol;
+                code_pos = 0;  // Reset for next code
+                current_code = 0;
+                break;
+            }
+        }
+    }
+    return output_size;
+}
+
+
+/******  *Function  : static int decode_huffman(const unsigned char *in, size_t size, char *out, size_t raw_len, unsigned int streams, const struct compress_options *opts)
+ *Description : decodes one payload written by write_huffman
+ *Parameters : in - Huffman payload, size - payload bytes
+ *              out - receives raw_len bytes
+ *              streams - bitstreams in the payload, 1 or HUFFMAN_STREAMS
+ *              opts - decoder choice
+ *Effects :
+ *Returned : 0 on success, -1 on a corrupt block
+ */
+
+static int decode_huffman(const unsigned char *in, size_t size, char *out, size_t raw_len,
+                          unsigned int streams, const struct compress_options *opts) {
+    struct code_table ct;
+    struct decode_table dt;
+    struct bit_reader br[HUFFMAN_STREAMS];
+    uint64_t bits_size[HUFFMAN_STREAMS];
+    long lengths_size;
+    size_t offset;
+    unsigned int s;
+    int ok = 1;
+
+    // Step 1: Rebuild the canonical code table from the code lengths
+    lengths_size = read_code_lengths(in, size, &ct);
+    if (lengths_size < 0) {
+        return -1;
+    }
+    offset = (size_t)lengths_size;
+
+    // Step 2: Read the jump table and check every stream is all there
+    if (size - offset < 4 * streams) {
+        return -1;
+    }
+    for (s = 0; s < streams; s++) {
+        bits_size[s] = get_u32(in + offset + 4 * s);
+    }
+    offset += 4 * streams;
+    for (s = 0; s < streams; s++) {
+        size_t bytes = (size_t)((bits_size[s] + 7) / 8);
+        if (bytes > size - offset || segment_len(raw_len, streams, s) > bits_size[s]) {
+            return -1;
+        }
+        br_init(&br[s], in + offset, bytes);
+        offset += bytes;
+    }
+
+    // Step 3: Decode bits using code table
+    if (opts->decoder == DECODE_SCAN) {
+        for (s = 0; ok && s < streams; s++) {
+            size_t len = segment_len(raw_len, streams, s);
+            ok = decode_scan(&ct, &br[s], bits_size[s],
+                             out + segment_start(raw_len, streams, s), len) == len;
+        }
+    } else {
+        ok = build_decode_table(&ct, &dt) == 0;
+        if (ok && opts->decoder == DECODE_MULTI && dt.trie == NULL &&
+            raw_len >= DECODE_MULTI_MIN) {
+            build_multi_table(&dt);
+            ok = decode_multi(&dt, br, out, raw_len, streams) == 0;
+        } else if (ok) {
+            ok = (streams == 1 ? decode_table_driven(&dt, &br[0], out, raw_len) :
+                                 decode_interleaved(&dt, br, out, raw_len)) == 0;
+        }
+        for (s = 0; ok && s < streams; s++) {
+            ok = br_consumed(&br[s]) <= bits_size[s];
+        }
+        free_decode_table(&dt);
+    }
+    return ok ? 0 : -1;
+}
+
+
+/******  *Function  : static int decode_entropy(const unsigned char *in, size_t size, char *out, size_t raw_len, unsigned int flags, const struct compress_options *opts)
+ *Description : decodes one entropy payload with the coder the block flags name
+ *Parameters : in, size - payload, out - receives raw_len bytes
+ *              flags - BLOCK_ANS and BLOCK_MULTI_STREAM bits of the block type
+ *              opts - decoder choice for Huffman payloads
+ *Effects :
+ *Returned : 0 on success, -1 on a corrupt payload
+ */
+
+static int decode_entropy(const unsigned char *in, size_t size, char *out, size_t raw_len,
+                          unsigned int flags, const struct compress_options *opts) {
+    if (flags & BLOCK_ANS) {
+        return ans_decode(in, size, (unsigned char *)out, raw_len);
+    }
+    return decode_huffman(in, size, out, raw_len,
+                          flags & BLOCK_MULTI_STREAM ? HUFFMAN_STREAMS : 1, opts);
+}
+
+
+/******  *Function  : static int decode_lz(const unsigned char *in, size_t size, char *out, size_t raw_len, unsigned int flags, const struct compress_options *opts)
+ *Description : decodes the token streams of a BLOCK_LZ payload and expands them
+ *Parameters : in - payload after the type byte, size - its bytes
+ *              out - receives raw_len bytes, flags - coder flags of the block type
+ *              opts - decoder choice
+ *Effects : stream sizes are checked against raw_len before anything is allocated
+ *Returned : 0 on success, -1 on a corrupt block
+ */
+
+static int decode_lz(const unsigned char *in, size_t size, char *out, size_t raw_len,
+                     unsigned int flags, const struct compress_options *opts) {
+    struct lz_sequences seq;
+    unsigned char *tokens[LZ_STREAMS] = {NULL, NULL, NULL};
+    size_t stream_sizes[LZ_STREAMS];
+    size_t offset = 4;
+    unsigned int i;
+    int result = -1;
+
+    if (size < 4) {
+        return -1;
+    }
+    seq.sequence_count = get_u32(in);
+    if (seq.sequence_count > raw_len / LZ_MIN_MATCH) {
+        return -1;
+    }
+    
+    // Step 1: Decode the literal, length and distance streams
+    for (i = 0; i < LZ_STREAMS; i++) {
+        size_t stream_len, comp_len;
+
+        if (size - offset < FRAME_HEADER_SIZE) {
+            break;
+        }
+        stream_len = get_u32(in + offset);
+        comp_len = get_u32(in + offset + 4);
+        offset += FRAME_HEADER_SIZE;
+        /* no stream holds more than two bytes of tokens per raw byte */
+        if (comp_len > size - offset || stream_len > 2 * raw_len) {
+            break;
+        }
+        tokens[i] = malloc(stream_len ? stream_len : 1);
+        if (!tokens[i] ||
+            (stream_len > 0 && decode_entropy(in + offset, comp_len, (char *)tokens[i],
+                                              stream_len, flags, opts) != 0)) {
+            break;
+        }
+        stream_sizes[i] = stream_len;
+        offset += comp_len;
+    }
+    
+    // Step 2: Replay the sequences into the output
+    if (i == LZ_STREAMS) {
+        seq.literals = tokens[0];
+        seq.literal_count = stream_sizes[0];
+        seq.lengths = tokens[1];
+        seq.lengths_size = stream_sizes[1];
+        seq.distances = tokens[2];
+        seq.distances_size = stream_sizes[2];
+        result = lz_expand(&seq, (unsigned char *)out, raw_len);
+    }
+    for (i = 0; i < LZ_STREAMS; i++) {
+        free(tokens[i]);
+    }
+    return result;
+}
+
+
+/******  *Function  : static int decode_block(const unsigned char *in, size_t size, char *out, size_t raw_len, const struct compress_options *opts)
+ *Description : decodes one block written by write_block
+ *Parameters : in - block payload, size - payload bytes
+ *              out - receives raw_len bytes, opts - decoder choice
+ *Effects :
+ *Returned : 0 on success, -1 on a corrupt block
+ */
+
+static int decode_block(const unsigned char *in, size_t size, char *out, size_t raw_len,
+                        const struct compress_options *opts) {
+    unsigned int flags;
+
+    if (size < 1) {
+        return -1;
+    }
+    flags = in[0] & (BLOCK_ANS | BLOCK_MULTI_STREAM);
+    switch (in[0] & ~flags) {
+    case BLOCK_STORED:
+        if (size - 1 != raw_len) {
+            return -1;
+        }
+        memcpy(out, in + 1, raw_len);
+        return 0;
+    case BLOCK_RLE:
+        if (size != 2) {
+            return -1;
+        }
+        memset(out, in[1], raw_len);
+        return 0;
+    case BLOCK_HUFFMAN:
+        return decode_entropy(in + 1, size - 1, out, raw_len, flags, opts);
+    case BLOCK_LZ:
+        return decode_lz(in + 1, size - 1, out, raw_len, flags, opts);
+    default:
+        return -1;
+    }
+}
+
+
+/* One frame of a compressed buffer, located before decoding starts */
+struct frame_ref {
+    const unsigned char *data;
+    size_t size;
+    size_t raw_offset;
+    size_t raw_len;
+};
+
+struct decode_job {
+    const struct frame_ref *frames;
+    char *output;
+    const struct compress_options *opts;
+    int *status;
+};
+
+static void decompress_block_task(void *ctx, size_t index) {
+    struct decode_job *job = (struct decode_job *)ctx;
+    const struct frame_ref *frame = &job->frames[index];
+
+    job->status[index] = decode_block(frame->data, frame->size, job->output + frame->raw_offset,
+                                      frame->raw_len, job->opts);
+}
+
+
+/******  *Function  : void compress_default_options(struct compress_options *opts)
+ *Description : fills opts with the settings used by compress() and decompress()
+ *Parameters : opts - options to initialise
+ *Effects :
+ *Returned : none
+ */
+
+void compress_default_options(struct compress_options *opts) {
+    if (opts == NULL) {
+        return;
+    }
+    opts->decoder = DECODE_MULTI;
+    opts->max_code_len = DECODE_TABLE_BITS;
+    opts->block_size = COMPRESS_BLOCK_SIZE;
+    opts->threads = 0;
+    opts->level = COMPRESS_LEVEL_DEFAULT;
+    opts->streams = HUFFMAN_STREAMS;
+    opts->codec = CODEC_HUFFMAN;
+}
+
+/******  *Function  : static int scan_frames(const unsigned char *in, size_t size, struct frame_ref **frames, size_t *frame_count, uint64_t *content_size)
+ *Description : checks the container header and locates every frame
+ *Parameters : in, size - compressed buffer
+ *              frames, frame_count - receive the malloc'd frame list (NULL if not wanted)
+ *              content_size - receives the decompressed size
+ *Effects : only the frame headers are read, no block is decoded
+ *Returned : 0 on success, -1 on a bad or truncated buffer
+ */
+
+static int scan_frames(const unsigned char *in, size_t size, struct frame_ref **frames,
+                       size_t *frame_count, uint64_t *content_size) {
+    struct frame_ref *list = NULL;
+    uint64_t original_len;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t raw_total = 0;
+    size_t offset;
+    
+    if (!in || size < COMPRESS_HEADER_SIZE) {
+        return -1;
+    }
+    
+    // Step 1: Check the header
+    if (memcmp(in, COMPRESS_MAGIC, 4) != 0 || in[4] != COMPRESS_VERSION) {
+        return -1;
+    }
+    original_len = get_u64(in + 5);
+    offset = COMPRESS_HEADER_SIZE;
+    if (original_len != COMPRESS_SIZE_UNKNOWN && original_len >= SIZE_MAX) {
+        return -1;
+    }
+    
+    // Step 2: Walk the frame headers up to the end frame
+    for (;;) {
+        size_t raw_len, comp_len;
+        
+        if (size - offset < FRAME_HEADER_SIZE) {
+            free(list);
+            return -1;
+        }
+        raw_len = get_u32(in + offset);
+        comp_len = get_u32(in + offset + 4);
+        offset += FRAME_HEADER_SIZE;
+        if (raw_len == 0) {
+            break;
+        }
+        if (raw_len > COMPRESS_MAX_BLOCK || comp_len > block_bound(raw_len) ||
+            comp_len > size - offset || raw_len > SIZE_MAX - 1 - raw_total ||
+            (original_len != COMPRESS_SIZE_UNKNOWN && raw_len > original_len - raw_total)) {
+            free(list);
+            return -1;
+        }
+        if (frames && count == capacity) {
+            struct frame_ref *grown;
+            capacity = capacity ? capacity * 2 : 16;
+            grown = realloc(list, capacity * sizeof(*list));
+            if (!grown) {
+                free(list);
+                return -1;
+            }
+            list = grown;
+        }
+        if (frames) {
+            list[count].data = in + offset;
+            list[count].size = comp_len;
+            list[count].raw_offset = raw_total;
+            list[count].raw_len = raw_len;
+        }
+        count++;
+        raw_total += raw_len;
+        offset += comp_len;
+    }
+    if (original_len != COMPRESS_SIZE_UNKNOWN && raw_total != original_len) {
+        free(list);
+        return -1;
+    }
+    
+    if (frames) {
+        *frames = list;
+        *frame_count = count;
+    }
+    *content_size = raw_total;
+    return 0;
+}
+
+
+/* Decodes the located frames in parallel straight into output */
+static int decode_frames(const struct frame_ref *frames, size_t frame_count, char *output,
+                         const struct compress_options *opts) {
+    struct decode_job job;
+    size_t i;
+    int result = 0;
+
+    job.status = calloc(frame_count ? frame_count : 1, sizeof(*job.status));
+    if (!job.status) {
+        return -1;
+    }
+    job.frames = frames;
+    job.output = output;
+    job.opts = opts;
+    if (parallel_for(frame_count, opts->threads, decompress_block_task, &job) != 0) {
+        result = -1;
+    }
+    for (i = 0; result == 0 && i < frame_count; i++) {
+        if (job.status[i] != 0) {
+            result = -1;
+        }
+    }
+    free(job.status);
+    return result;
+}
+
+
+/******  *Function  : int decompressed_size(const void* compressed, size_t compressedSize, size_t* size)
+ *Description : reports how many bytes a compressed buffer decodes to
+ *Parameters : compressed, compressedSize - output of compress_data() or a stream
+ *              size - receives the decompressed size
+ *Effects : streamed data with no size in its header has its frame headers summed
+ *Returned : 0 on success, -1 on a bad buffer
+ */
+
+int decompressed_size(const void* compressed, size_t compressedSize, size_t* size) {
+    uint64_t content_size;
+
+    if (!size || scan_frames((const unsigned char *)compressed, compressedSize, NULL, NULL,
+                             &content_size) != 0) {
+        return -1;
+    }
+    *size = (size_t)content_size;
+    return 0;
+}
+
+
+/******  *Function  : int decompress_buffer(const void* compressed, size_t compressedSize, void* output, size_t outputCapacity, size_t* outputSize, const struct compress_options *opts)
+ *Description : decompresses into a caller's buffer
+ *Parameters : compressed, compressedSize - compressed data
+ *              output, outputCapacity - destination buffer
+ *              outputSize - receives the decompressed size, or the size needed
+ *              when output is too small
+ *              opts - settings (NULL for defaults)
+ *Effects : nothing is appended; the output is exactly the original bytes
+ *Returned : 0 on success, -1 on failure or if output is too small
+ */
 
-    if (strncmp(header, "HUFFMAN_TREE", 18) != 0){
-        fclose(file);
-        return -1;
-    }
+int decompress_buffer(const void* compressed, size_t compressedSize, void* output,
+                      size_t outputCapacity, size_t* outputSize,
+                      const struct compress_options *opts) {
+    struct compress_options defaults;
+    struct frame_ref *frames = NULL;
+    size_t frame_count = 0;
+    uint64_t content_size;
+    int result = -1;
 
-    if (initialise_code_table(ct) != 0){
-        fclose(file);
+    if (!outputSize) {
         return -1;
     }
-
-    if (fscanf(file, "%u\n", &count) != 1){
-        fclose(file);
+    if (!opts) {
+        compress_default_options(&defaults);
+        opts = &defaults;
+    }
+    if (scan_frames((const unsigned char *)compressed, compressedSize, &frames, &frame_count,
+                    &content_size) != 0) {
         return -1;
     }
+    *outputSize = (size_t)content_size;
+    if ((output || content_size == 0) && content_size <= outputCapacity) {
+        result = decode_frames(frames, frame_count, (char *)output, opts);
+    }
+    free(frames);
+    return result;
+}
 
-    for (i = 0U; i<count ; i++){
-        if (fscanf(file, "%s %s %lu\n", symbol_str, code, &length) != 3) {
-            fclose(file);
-            return -1;
-        }
-        
 
-        if (strcmp(symbol_str, "\\n") == 0) 
-        {
-            symbol = '\n';
-        } 
-        else if (strcmp(symbol_str, "\\s") == 0) 
-        {
-            symbol = ' ';
-        } 
-        else if (strcmp(symbol_str, "\\\\") == 0) 
-        {
-            symbol = '\\';
-        } 
-        else if (symbol_str[0] == '\\' && symbol_str[1] == 'x') 
-        {
-            sscanf(symbol_str + 2, "%hhx", &symbol);
-        } 
-        else 
-        {
-            symbol = (unsigned char)symbol_str[0];
-        }
-        
+/******  *Function  : int is_legacy_compressed(const void* data, size_t size)
+ *Description : recognises the format compress() wrote before the HUFZ container
+ *Parameters : data, size - the start of a compressed buffer (the first
+ *              LEGACY_PREFIX_SIZE bytes are enough)
+ *Effects : none
+ *Returned : 1 if data has no HUFZ magic and starts like an old buffer, else 0
+ */
+
+int is_legacy_compressed(const void* data, size_t size) {
+    const unsigned char *p = (const unsigned char *)data;
 
-        strcpy(ct->code[symbol], code);
-        ct->length[symbol] = length;
+    if (!p || size < LEGACY_PREFIX_SIZE || memcmp(p, COMPRESS_MAGIC, 4) == 0) {
+        return 0;
     }
+    return memcmp(p + sizeof(size_t), LEGACY_TABLE_TAG, strlen(LEGACY_TABLE_TAG)) == 0;
+}
 
 
-    fclose(file);
+/******  *Function  : char* decompress_legacy(const char* compressed, size_t compressedSize, size_t* outputSize)
+ *Description : decodes a buffer in the old format: tree size (size_t), the
+ *              "HUFFMAN_TABLE" code text, bit count (size_t), then one '0'
+ *              or '1' character per bit
+ *Parameters : compressed, compressedSize - old compress() output
+ *              outputSize - receives the decoded size (may be NULL)
+ *Effects : the codes are put in a binary trie and the bits walked through it
+ *Returned : NUL-terminated output, or NULL on a bad buffer
+ */
 
+char* decompress_legacy(const char* compressed, size_t compressedSize, size_t* outputSize) {
+    /* trie of at most 2 * NUM_SYMBOLS nodes; child 0 means none, and a
+     * leaf holds -1 - symbol */
+    static const size_t max_nodes = 2 * NUM_SYMBOLS;
+    int (*trie)[2] = NULL;
+    size_t nodes = 1;
+    size_t tree_size, bits_size, offset, i;
+    const char *ptr, *end, *bits;
+    char *output = NULL;
+    size_t produced = 0;
+    unsigned int count;
+    int node, bad;
+
+    if (!is_legacy_compressed(compressed, compressedSize)) {
+        return NULL;
+    }
 
-    return 0;
- }
+    // Step 1: Find the code text and the bits
+    memcpy(&tree_size, compressed, sizeof(size_t));
+    offset = sizeof(size_t);
+    if (tree_size > compressedSize - offset ||
+        compressedSize - offset - tree_size < sizeof(size_t)) {
+        return NULL;
+    }
+    ptr = compressed + offset + strlen(LEGACY_TABLE_TAG);
+    end = compressed + offset + tree_size;
+    offset += tree_size;
+    memcpy(&bits_size, compressed + offset, sizeof(size_t));
+    offset += sizeof(size_t);
+    if (bits_size > compressedSize - offset) {
+        return NULL;
+    }
+    bits = compressed + offset;
 
- // Helper: Serialize code table to a string
-static char* serialize_code_table(struct code_table *ct, size_t *output_size) {
-    char *buffer = NULL;
-    size_t buffer_capacity = 4096;  // Start with 4KB
-    size_t buffer_used = 0;
-    unsigned int count = 0;
-    
-    if (!ct || !output_size) {
+    // Step 2: Read "symbol code length" lines into the trie
+    trie = calloc(max_nodes, sizeof(*trie));
+    if (!trie) {
         return NULL;
     }
-    
-    buffer = malloc(buffer_capacity);
-    if (!buffer) {
+    count = 0;
+    while (ptr < end && *ptr >= '0' && *ptr <= '9') {
+        count = count * 10 + (unsigned int)(*ptr++ - '0');
+    }
+    if (ptr >= end || *ptr != '\n' || count == 0 || count > NUM_SYMBOLS) {
+        free(trie);
         return NULL;
     }
-    
-    // Count symbols with codes
-    for (unsigned int i = 0; i < NUM_SYMBOLS; i++) {
-        if (ct->length[i] > 0) {
-            count++;
+    ptr++;
+    for (i = 0; i < count; i++) {
+        const char *field = ptr;
+        unsigned int symbol;
+
+        // symbol: a printable character or an escape
+        if (ptr + 1 < end && ptr[0] == '\\' && ptr[1] == 'n') {
+            symbol = '\n';
+            ptr += 2;
+        } else if (ptr + 1 < end && ptr[0] == '\\' && ptr[1] == 's') {
+            symbol = ' ';
+            ptr += 2;
+        } else if (ptr + 1 < end && ptr[0] == '\\' && ptr[1] == '\\') {
+            symbol = '\\';
+            ptr += 2;
+        } else if (ptr + 3 < end && ptr[0] == '\\' && ptr[1] == 'x' &&
+                   isxdigit((unsigned char)ptr[2]) && isxdigit((unsigned char)ptr[3])) {
+            char hex[3] = { ptr[2], ptr[3], '\0' };
+            symbol = (unsigned int)strtoul(hex, NULL, 16);
+            ptr += 4;
+        } else if (ptr < end) {
+            symbol = (unsigned char)*ptr++;
+        } else {
+            break;
         }
-    }
-    
-    // Write header
-    buffer_used += sprintf(buffer + buffer_used, "HUFFMAN_TABLE\n%u\n", count);
-    
-    // Write each symbol's code
-    for (unsigned int i = 0; i < NUM_SYMBOLS; i++) {
-        if (ct->length[i] > 0) {
-            // Check if we need more space
-            if (buffer_used + 300 > buffer_capacity) {
-                buffer_capacity *= 2;
-                char *new_buffer = realloc(buffer, buffer_capacity);
-                if (!new_buffer) {
-                    free(buffer);
-                    return NULL;
-                }
-                buffer = new_buffer;
+        if (ptr >= end || *ptr != ' ' || ptr == field) {
+            break;
+        }
+        ptr++;
+
+        // code: walk it into the trie, ending in a fresh leaf
+        node = 0;
+        bad = 0;
+        while (ptr < end && (*ptr == '0' || *ptr == '1')) {
+            int bit = *ptr++ - '0';
+            if (trie[node][0] < 0 || (trie[node][bit] == 0 && nodes == max_nodes)) {
+                bad = 1;
+                break;
             }
-            
-            // Format: symbol code length
-            // Handle special characters
-            if (i == '\n') {
-                buffer_used += sprintf(buffer + buffer_used, "\\n %s %u\n", 
-                                      ct->code[i], ct->length[i]);
-            } else if (i == ' ') {
-                buffer_used += sprintf(buffer + buffer_used, "\\s %s %u\n", 
-                                      ct->code[i], ct->length[i]);
-            } else if (i == '\\') {
-                buffer_used += sprintf(buffer + buffer_used, "\\\\ %s %u\n", 
-                                      ct->code[i], ct->length[i]);
-            } else if (i >= 32 && i <= 126) {
-                buffer_used += sprintf(buffer + buffer_used, "%c %s %u\n", 
-                                      (char)i, ct->code[i], ct->length[i]);
-            } else {
-                buffer_used += sprintf(buffer + buffer_used, "\\x%02X %s %u\n", 
-                                      i, ct->code[i], ct->length[i]);
+            if (trie[node][bit] == 0) {
+                trie[node][bit] = (int)nodes++;
             }
+            node = trie[node][bit];
         }
-    }
-    
-    *output_size = buffer_used;
-    return buffer;
-}
+        if (bad || node == 0 || trie[node][0] != 0 || trie[node][1] != 0) {
+            break;
+        }
+        trie[node][0] = -1 - (int)symbol;
+        trie[node][1] = -1;
 
- // New function - works with memory buffers
-char* compress(const char* input, size_t* outputSize) {
-    struct frequency_table ft;
-    struct code_table ct;
-    struct huffman_node *node;
-    char *compressed_bits = NULL;
-    char *tree_data = NULL;
-    char *final_output = NULL;
-    size_t bits_size = 0;
-    size_t tree_size = 0;
-    size_t offset = 0;
-    
-    if (!input || !outputSize) {
+        // length: already implied by the code
+        while (ptr < end && *ptr != '\n') {
+            ptr++;
+        }
+        if (ptr < end) {
+            ptr++;
+        }
+    }
+    if (i != count) {
+        free(trie);
         return NULL;
     }
-    
-    size_t input_len = strlen(input);
-    if (input_len == 0) {
-        *outputSize = 0;
+
+    // Step 3: Walk the bits; every leaf reached gives one byte
+    output = malloc(bits_size + 1);
+    if (!output) {
+        free(trie);
         return NULL;
     }
-    
-    // Step 1: Build frequency table
-    initialise_Frequency(&ft);
-    for (size_t i = 0; i < input_len; i++) {
-        ft.freq[(unsigned char)input[i]]++;
+    node = 0;
+    for (i = 0; i < bits_size; i++) {
+        if (bits[i] != '0' && bits[i] != '1') {
+            break;
+        }
+        node = trie[node][bits[i] - '0'];
+        if (node == 0) {
+            break;
+        }
+        if (trie[node][0] < 0) {
+            output[produced++] = (char)(-1 - trie[node][0]);
+            node = 0;
+        }
     }
-    
-    // Step 2: Build Huffman tree
-    if (build_Tree(&ft, &node) != 0) {
+    free(trie);
+    if (i != bits_size || node != 0) {
+        free(output);
         return NULL;
     }
-    
-    // Step 3: Generate encoding table
-    if (generate_encoding(node, &ct) != 0) {
-        free_huffman_tree(node);
-        return NULL;
+
+    output[produced] = '\0';
+    if (outputSize) {
+        *outputSize = produced;
     }
+    return output;
+}
+
+
+char* decompress(const char* compressed, size_t compressedSize) {
+    struct compress_options opts;
+
+    compress_default_options(&opts);
+    return decompress_with_options(compressed, compressedSize, &opts);
+}
+
+/* Allocating front end to decompress_buffer(); the result is NUL-terminated
+ * so text callers can use it directly */
+char* decompress_with_options(const char* compressed, size_t compressedSize,
+                              const struct compress_options *opts) {
+    struct frame_ref *frames = NULL;
+    char *output_buffer = NULL;
+    size_t frame_count = 0;
+    uint64_t original_len;
     
-    // Step 4: Serialize code table to string
-    tree_data = serialize_code_table(&ct, &tree_size);
-    if (!tree_data) {
-        free_huffman_tree(node);
+    if (!compressed || !opts) {
         return NULL;
     }
-    
-    // Step 5: Encode input to binary string
-    size_t estimated_size = 0;
-    for (size_t i = 0; i < input_len; i++) {
-        unsigned char symbol = (unsigned char)input[i];
-        estimated_size += ct.length[symbol];
+    if (is_legacy_compressed(compressed, compressedSize)) {
+        return decompress_legacy(compressed, compressedSize, NULL);
     }
-    
-    compressed_bits = malloc(estimated_size + 1);
-    if (!compressed_bits) {
-        free(tree_data);
-        free_huffman_tree(node);
+    if (scan_frames((const unsigned char *)compressed, compressedSize, &frames, &frame_count,
+                    &original_len) != 0) {
         return NULL;
     }
     
-    bits_size = 0;
-    for (size_t i = 0; i < input_len; i++) {
-        unsigned char symbol = (unsigned char)input[i];
-        for (unsigned int j = 0; j < ct.length[symbol]; j++) {
-            compressed_bits[bits_size++] = ct.code[symbol][j];
-        }
+    output_buffer = malloc((size_t)original_len + 1);
+    if (output_buffer && decode_frames(frames, frame_count, output_buffer, opts) != 0) {
+        free(output_buffer);
+        output_buffer = NULL;
     }
-    compressed_bits[bits_size] = '\0';
+    free(frames);
     
-    // Step 6: Combine tree + compressed data
-    // Format: [tree_size][tree_data][bits_size][compressed_bits]
-    size_t total_size = sizeof(size_t) + tree_size + sizeof(size_t) + bits_size;
-    final_output = malloc(total_size);
-    if (!final_output) {
-        free(tree_data);
-        free(compressed_bits);
-        free_huffman_tree(node);
+    if (!output_buffer) {
         return NULL;
     }
-    
-    // Write tree size
-    memcpy(final_output + offset, &tree_size, sizeof(size_t));
-    offset += sizeof(size_t);
-    
-    // Write tree data
-    memcpy(final_output + offset, tree_data, tree_size);
-    offset += tree_size;
-    
-    // Write bits size
-    memcpy(final_output + offset, &bits_size, sizeof(size_t));
-    offset += sizeof(size_t);
-    
-    // Write compressed bits
-    memcpy(final_output + offset, compressed_bits, bits_size);
-    
-    // Cleanup
-    free(tree_data);
-    free(compressed_bits);
-    free_huffman_tree(node);
-    
-    *outputSize = total_size;
-    return final_output;
+    output_buffer[original_len] = '\0';
+    return output_buffer;
 }
 
-// Helper: Deserialize code table from string
-static int deserialize_code_table(const char* data, size_t data_size, struct code_table *ct) {
-    const char *ptr = data;
-    const char *end = data + data_size;
-    unsigned int count = 0;
-    unsigned int i;
-    
-    if (!data || !ct) {
+
+/******  *Function  : static int flush_batch(struct compress_stream *cs)
+ *Description : codes the buffered input as blocks and hands the frames to the sink
+ *Parameters : cs - compress stream
+ *Effects : the blocks of one batch are coded in parallel; the buffer is emptied
+ *Returned : 0 on success and -1 on fail
+ */
+
+static unsigned int stream_batch_blocks(const struct compress_options *opts) {
+    return opts->threads == 0 ? parallel_cpu_count() : opts->threads;
+}
+
+static int flush_batch(struct compress_stream *cs) {
+    struct block_job job;
+    unsigned char *frames = NULL;
+    int result = -1;
+
+    if (cs->buffered == 0) {
+        return 0;
+    }
+    if (plan_blocks(&job, cs->buffer, cs->buffered, &cs->opts) == 0) {
+        frames = malloc(job.frames_size);
+        if (frames && write_blocks(&job, frames) == 0 &&
+            cs->sink(cs->ctx, frames, job.frames_size) == 0) {
+            result = 0;
+        }
+    }
+    free(frames);
+    free_block_job(&job);
+    cs->buffered = 0;
+    return result;
+}
+
+
+/******  *Function  : int compress_stream_init(struct compress_stream *cs, const struct compress_options *opts, uint64_t content_size, compress_sink sink, void *ctx)
+ *Description : starts an incremental compressor that writes the compress() format to sink
+ *Parameters : cs - stream to set up, opts - settings (NULL for defaults)
+ *              content_size - total input size, or COMPRESS_SIZE_UNKNOWN
+ *              sink, ctx - output callback and its argument
+ *Effects : writes the container header; holds at most one block per thread of input
+ *Returned : 0 on success and -1 on fail
+ */
+
+int compress_stream_init(struct compress_stream *cs, const struct compress_options *opts,
+                         unsigned long long content_size, compress_sink sink, void *ctx) {
+    unsigned char header[COMPRESS_HEADER_SIZE];
+
+    if (cs == NULL || sink == NULL) {
         return -1;
     }
-    
-    // Initialize code table
-    if (initialise_code_table(ct) != 0) {
+    if (opts != NULL) {
+        cs->opts = *opts;
+    } else {
+        compress_default_options(&cs->opts);
+    }
+    cs->sink = sink;
+    cs->ctx = ctx;
+    cs->block_size = effective_block_size(&cs->opts);
+    cs->capacity = cs->block_size * stream_batch_blocks(&cs->opts);
+    cs->buffered = 0;
+    cs->content_size = content_size;
+    cs->total_in = 0;
+    cs->buffer = malloc(cs->capacity);
+    if (cs->buffer == NULL) {
         return -1;
     }
-    
-    // Read header "HUFFMAN_TABLE\n"
-    if (strncmp(ptr, "HUFFMAN_TABLE\n", 14) != 0) {
+
+    write_container_header(header, content_size);
+    if (sink(ctx, header, COMPRESS_HEADER_SIZE) != 0) {
+        free(cs->buffer);
+        cs->buffer = NULL;
         return -1;
     }
-    ptr += 14;
-    
-    // Read count
-    if (sscanf(ptr, "%u\n", &count) != 1) {
+    return 0;
+}
+
+int compress_stream_write(struct compress_stream *cs, const void *data, size_t len) {
+    const char *p = (const char *)data;
+
+    if (cs == NULL || cs->buffer == NULL || (p == NULL && len > 0)) {
         return -1;
     }
-    
-    // Skip to next line
-    while (ptr < end && *ptr != '\n') ptr++;
-    if (ptr < end) ptr++;  // Skip newline
-    
-    // Read each symbol entry
-    for (i = 0; i < count; i++) {
-        char symbol_str[10];
-        char code[MAX_CODE_LEN];
-        unsigned int length;
-        unsigned char symbol;
-        
-        // Read one line: symbol code length
-        int items = sscanf(ptr, "%s %s %u\n", symbol_str, code, &length);
-        if (items != 3) {
-            return -1;
+    cs->total_in += len;
+    while (len > 0) {
+        size_t take = cs->capacity - cs->buffered;
+        if (take > len) {
+            take = len;
         }
-        
-        // Parse symbol
-        if (strcmp(symbol_str, "\\n") == 0) {
-            symbol = '\n';
-        } else if (strcmp(symbol_str, "\\s") == 0) {
-            symbol = ' ';
-        } else if (strcmp(symbol_str, "\\\\") == 0) {
-            symbol = '\\';
-        } else if (symbol_str[0] == '\\' && symbol_str[1] == 'x') {
-            sscanf(symbol_str + 2, "%hhx", &symbol);
-        } else {
-            symbol = (unsigned char)symbol_str[0];
+        memcpy(cs->buffer + cs->buffered, p, take);
+        cs->buffered += take;
+        p += take;
+        len -= take;
+        if (cs->buffered == cs->capacity && flush_batch(cs) != 0) {
+            return -1;
         }
-        
-        // Store in code table
-        strcpy(ct->code[symbol], code);
-        ct->length[symbol] = length;
-        
-        // Move to next line
-        while (ptr < end && *ptr != '\n') ptr++;
-        if (ptr < end) ptr++;  // Skip newline
     }
-    
     return 0;
 }
 
-char* decompress(const char* compressed, size_t compressedSize) {
-    struct code_table ct;
-    char *output_buffer = NULL;
-    size_t output_capacity = 1024;
-    size_t output_size = 0;
-    size_t tree_size = 0;
-    size_t bits_size = 0;
-    const char *tree_data = NULL;
-    const char *compressed_bits = NULL;
-    size_t offset = 0;
-    
-    if (!compressed || compressedSize == 0) {
-        return NULL;
+/* Codes whatever is left and writes the end frame */
+int compress_stream_finish(struct compress_stream *cs) {
+    unsigned char end[FRAME_HEADER_SIZE];
+
+    if (cs == NULL || cs->buffer == NULL || flush_batch(cs) != 0) {
+        return -1;
     }
-    
-    // Step 1: Extract tree size
-    if (compressedSize < sizeof(size_t)) {
-        return NULL;
+    if (cs->content_size != COMPRESS_SIZE_UNKNOWN && cs->content_size != cs->total_in) {
+        return -1;
     }
-    memcpy(&tree_size, compressed + offset, sizeof(size_t));
-    offset += sizeof(size_t);
-    
-    // Step 2: Extract tree data
-    if (offset + tree_size > compressedSize) {
-        return NULL;
+    memset(end, 0, sizeof(end));
+    return cs->sink(cs->ctx, end, FRAME_HEADER_SIZE);
+}
+
+void compress_stream_free(struct compress_stream *cs) {
+    if (cs != NULL) {
+        free(cs->buffer);
+        cs->buffer = NULL;
     }
-    tree_data = compressed + offset;
-    offset += tree_size;
-    
-    // Step 3: Deserialize code table
-    if (deserialize_code_table(tree_data, tree_size, &ct) != 0) {
-        return NULL;
+}
+
+
+/******  *Function  : int decompress_stream_init(struct decompress_stream *ds, const struct compress_options *opts, compress_sink sink, void *ctx)
+ *Description : starts an incremental decoder for the compress() format
+ *Parameters : ds - stream to set up, opts - settings (NULL for defaults)
+ *              sink, ctx - receives each decoded block
+ *Effects : compressed bytes can be written in pieces of any size
+ *Returned : 0 on success and -1 on fail
+ */
+
+int decompress_stream_init(struct decompress_stream *ds, const struct compress_options *opts,
+                           compress_sink sink, void *ctx) {
+    if (ds == NULL || sink == NULL) {
+        return -1;
     }
-    
-    // Step 4: Extract bits size
-    if (offset + sizeof(size_t) > compressedSize) {
-        return NULL;
+    memset(ds, 0, sizeof(*ds));
+    if (opts != NULL) {
+        ds->opts = *opts;
+    } else {
+        compress_default_options(&ds->opts);
     }
-    memcpy(&bits_size, compressed + offset, sizeof(size_t));
-    offset += sizeof(size_t);
-    
-    // Step 5: Extract compressed bits
-    if (offset + bits_size > compressedSize) {
-        return NULL;
+    ds->sink = sink;
+    ds->ctx = ctx;
+    ds->state = DSTREAM_HEADER;
+    ds->need = COMPRESS_HEADER_SIZE;
+    return 0;
+}
+
+/* Decodes one complete frame payload and passes the bytes on */
+static int decode_frame(struct decompress_stream *ds, const unsigned char *payload) {
+    if (ds->raw_len > ds->out_capacity) {
+        char *grown = realloc(ds->out, ds->raw_len);
+        if (grown == NULL) {
+            return -1;
+        }
+        ds->out = grown;
+        ds->out_capacity = ds->raw_len;
     }
-    compressed_bits = compressed + offset;
-    
-    // Step 6: Decode bits using code table
-    output_buffer = malloc(output_capacity);
-    if (!output_buffer) {
-        return NULL;
+    if (decode_block(payload, ds->need, ds->out, ds->raw_len, &ds->opts) != 0) {
+        return -1;
     }
-    
-    char current_code[MAX_CODE_LEN];
-    unsigned int code_pos = 0;
-    
-    for (size_t i = 0; i < bits_size; i++) {
-        current_code[code_pos++] = compressed_bits[i];
-        current_code[code_pos] = '\0';
-        
-        // Check if current_code matches any symbol's code
-        for (unsigned int symbol = 0; symbol < NUM_SYMBOLS; symbol++) {
-            if (ct.length[symbol] > 0 && strcmp(current_code, ct.code[symbol]) == 0) {
-                // Found matching code!
-                
-                // Expand buffer if needed
-                if (output_size + 1 >= output_capacity) {
-                    output_capacity *= 2;
-                    char *new_buffer = realloc(output_buffer, output_capacity);
-                    if (!new_buffer) {
-                        free(output_buffer);
-                        return NULL;
-                    }
-                    output_buffer = new_buffer;
-                }
-                
-                output_buffer[output_size++] = (char)symbol;
-                code_pos = 0;  // Reset for next code
-                break;
+    ds->produced += ds->raw_len;
+    return ds->sink(ds->ctx, ds->out, ds->raw_len);
+}
+
+/* Acts on a complete header, frame header or payload held in ds->pending */
+static int decompress_stream_step(struct decompress_stream *ds, const unsigned char *data) {
+    switch (ds->state) {
+    case DSTREAM_HEADER:
+        if (memcmp(data, COMPRESS_MAGIC, 4) != 0 || data[4] != COMPRESS_VERSION) {
+            return -1;
+        }
+        ds->content_size = get_u64(data + 5);
+        ds->state = DSTREAM_FRAME;
+        ds->need = FRAME_HEADER_SIZE;
+        return 0;
+    case DSTREAM_FRAME:
+        ds->raw_len = get_u32(data);
+        ds->need = get_u32(data + 4);
+        if (ds->raw_len == 0) {
+            ds->state = DSTREAM_DONE;
+            ds->need = 0;
+            return 0;
+        }
+        if (ds->raw_len > COMPRESS_MAX_BLOCK || ds->need > block_bound(ds->raw_len) ||
+            (ds->content_size != COMPRESS_SIZE_UNKNOWN &&
+             ds->raw_len > ds->content_size - ds->produced)) {
+            return -1;
+        }
+        ds->state = DSTREAM_PAYLOAD;
+        return 0;
+    case DSTREAM_PAYLOAD:
+        if (decode_frame(ds, data) != 0) {
+            return -1;
+        }
+        ds->state = DSTREAM_FRAME;
+        ds->need = FRAME_HEADER_SIZE;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+int decompress_stream_write(struct decompress_stream *ds, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+
+    if (ds == NULL || ds->failed || (p == NULL && len > 0)) {
+        return -1;
+    }
+    while (len > 0) {
+        if (ds->state == DSTREAM_DONE) {
+            ds->failed = 1;
+            return -1;
+        }
+        /* a piece that is all there is used in place rather than copied */
+        if (ds->have == 0 && len >= ds->need) {
+            size_t need = ds->need;
+            if (decompress_stream_step(ds, p) != 0) {
+                ds->failed = 1;
+                return -1;
+            }
+            p += need;
+            len -= need;
+            continue;
+        }
+        if (ds->need > ds->pending_capacity) {
+            unsigned char *grown = realloc(ds->pending, ds->need);
+            if (grown == NULL) {
+                ds->failed = 1;
+                return -1;
+            }
+            ds->pending = grown;
+            ds->pending_capacity = ds->need;
+        }
+        {
+            size_t take = ds->need - ds->have;
+            if (take > len) {
+                take = len;
+            }
+            memcpy(ds->pending + ds->have, p, take);
+            ds->have += take;
+            p += take;
+            len -= take;
+        }
+        if (ds->have == ds->need) {
+            ds->have = 0;
+            if (decompress_stream_step(ds, ds->pending) != 0) {
+                ds->failed = 1;
+                return -1;
             }
         }
     }
-    
-    output_buffer[output_size] = '\0';
-    return output_buffer;
+    return 0;
+}
+
+/* Checks that the end frame arrived and the sizes add up */
+int decompress_stream_finish(struct decompress_stream *ds) {
+    if (ds == NULL || ds->failed || ds->state != DSTREAM_DONE) {
+        return -1;
+    }
+    if (ds->content_size != COMPRESS_SIZE_UNKNOWN && ds->content_size != ds->produced) {
+        return -1;
+    }
+    return 0;
+}
+
+void decompress_stream_free(struct decompress_stream *ds) {
+    if (ds != NULL) {
+        free(ds->pending);
+        free(ds->out);
+        ds->pending = NULL;
+        ds->out = NULL;
+    }
 }
@@ -2,6 +2,7 @@
 #define COMPRESSION_H
 
 #include <stdio.h>
+#include <stdint.h>
 
 #define NUM_SYMBOLS     256u
 #define COMPOSITE_NODE  (-1)
@@ -10,44 +11,223 @@ typedef unsigned long long count_Table;
 
 struct frequency_table { count_Table freq[NUM_SYMBOLS]; };
 
+/* Nodes live in a huffman_tree arena; links are indexes into it */
+#define NO_NODE         (-1)
+#define MAX_TREE_NODES  (2 * (int)NUM_SYMBOLS - 1)
+
 struct huffman_node {
     int value;
     count_Table freq;
     int level;
     int ignore;
-    struct huffman_node *left, *right, *parent;
+    int left, right, parent;
+};
+
+struct huffman_tree {
+    struct huffman_node nodes[MAX_TREE_NODES];
+    int count;
+    int root;
 };
 
+/* Canonical codes, right-aligned with the first bit most significant.
+ * A tree can be MAX_CODE_LEN - 1 deep, but codes are only assigned once
+ * every length is within HUFFMAN_MAX_BITS */
 #define MAX_CODE_LEN 256
 struct code_table {
-    char code[NUM_SYMBOLS][MAX_CODE_LEN];
-    unsigned int length[NUM_SYMBOLS];
+    uint32_t code[NUM_SYMBOLS];
+    unsigned char length[NUM_SYMBOLS];
 };
 
 int initialise_Frequency(struct frequency_table *ft);
 int testMessage(void);
-struct huffman_node * merge_tree (struct huffman_node *left, struct huffman_node *right);
-int build_Tree(const struct frequency_table *ft, struct huffman_node **out_root);
+int merge_tree (struct huffman_tree *tree, int left, int right);
+int build_Tree(const struct frequency_table *ft, struct huffman_tree **out_tree);
 int count_Freq(FILE*input,struct frequency_table*ft);
-struct huffman_node *build_tree_from_frequency(const struct frequency_table *ft);
+int count_frequencies(const unsigned char *data, size_t len, struct frequency_table *ft);
+int count_frequencies_parallel(const unsigned char *data, size_t len, unsigned int threads,
+                               struct frequency_table *ft);
+struct huffman_tree *build_tree_from_frequency(const struct frequency_table *ft);
+struct huffman_tree *build_tree_from_frequency_heap(const struct frequency_table *ft);
 int initialise_code_table(struct code_table *ct);
 
-int generate_encoding(struct huffman_node *node, struct code_table*ct);
-void free_huffman_tree(struct huffman_node *node);
+int generate_encoding(const struct huffman_tree *tree, struct code_table*ct);
+int assign_canonical_codes(struct code_table *ct);
+int generate_limited_encoding(const struct frequency_table *ft, unsigned int max_len, struct code_table *ct);
+
+/* Code length header: longest length, symbol count, then (symbol, length)
+ * pairs or all 256 lengths as nibbles/bytes; the canonical codes are
+ * rebuilt from it */
+#define CODE_LENGTHS_MAX_SIZE (2 + NUM_SYMBOLS)
+#define CODE_LENGTHS_TAG      "HUFL"
+
+/* A header of the single byte CODE_LENGTHS_STATIC stands for the built-in
+ * table from static_code_table(), trained on English diary text; every
+ * byte has a code of at most STATIC_TABLE_MAX_BITS bits */
+#define CODE_LENGTHS_STATIC   0
+#define STATIC_TABLE_MAX_BITS 11
+int static_code_table(struct code_table *ct);
+size_t write_code_lengths(const struct code_table *ct, unsigned char *out);
+long read_code_lengths(const unsigned char *in, size_t size, struct code_table *ct);
+void free_huffman_tree(struct huffman_tree *tree);
 
 
 /*----------File-------------*/
 int encode_file(FILE*input, FILE*output, struct code_table *ct);
 int compress_file(const char *input_file, const char *output_file);
+int decompress_file(const char *input_file, const char *output_file);
 
 
 /*---------tree structure save----------*/
  int load_Tree(const char*filename, struct code_table *ct);
  int save_Tree(const char *filename, struct code_table *ct);
 
-/* Memory-based compression/decompression for integration */
+/* Memory-based compression/decompression for integration.
+ * Output layout: "HUFZ", version byte, original length (u64), then one
+ * frame per block: raw length (u32), payload size (u32), payload. A frame
+ * with raw length 0 ends the stream. A payload starts with its block type:
+ * BLOCK_HUFFMAN is followed by a code length header, payload bit count
+ * (u32) and canonical codes packed most significant bit first. With
+ * BLOCK_MULTI_STREAM set, each Huffman payload instead splits its symbols
+ * into HUFFMAN_STREAMS consecutive runs, each coded into its own byte-aligned
+ * bitstream, after a jump table of one bit count (u32) per stream. BLOCK_LZ
+ * holds LZ77 sequences as literal, length and distance streams, each
+ * Huffman coded the same way (see lz77.h). With BLOCK_ANS set, every
+ * entropy payload of the block is tANS coded instead (see ans.h); the
+ * bitstream flag then has no meaning. BLOCK_STORED holds the raw bytes
+ * and BLOCK_RLE the one byte a block repeats throughout; a block is stored
+ * whenever coding would not make it smaller. Blocks code and decode
+ * independently. Integers are little-endian. The original length is
+ * COMPRESS_SIZE_UNKNOWN when a stream was written without knowing it. */
+#define COMPRESS_MAGIC        "HUFZ"
+#define COMPRESS_VERSION      5
+#define COMPRESS_HEADER_SIZE  13
+#define FRAME_HEADER_SIZE     8
+#define COMPRESS_BLOCK_SIZE   (256u * 1024u)
+#define COMPRESS_MAX_BLOCK    (16u * 1024u * 1024u)
+#define COMPRESS_SIZE_UNKNOWN 0xFFFFFFFFFFFFFFFFULL
+#define HUFFMAN_MAX_BITS      32u
+
+#define BLOCK_HUFFMAN      0
+#define BLOCK_LZ           1
+#define BLOCK_STORED       2
+#define BLOCK_RLE          3
+#define BLOCK_ANS          0x40
+#define BLOCK_MULTI_STREAM 0x80
+#define HUFFMAN_STREAMS    4
+
 char* compress(const char* input, size_t* outputSize);
 char* decompress(const char* compressed, size_t compressedSize);
 
+/* Format compress() wrote before the HUFZ container: tree size (size_t),
+ * "HUFFMAN_TABLE\n", the symbol count and one "symbol code length" line per
+ * symbol, then the bit count (size_t) and one '0' or '1' character per bit,
+ * integers in host byte order. It is only read, so diaries from then can
+ * still be opened; decompress() falls back to it when the magic is missing */
+#define LEGACY_TABLE_TAG   "HUFFMAN_TABLE\n"
+#define LEGACY_PREFIX_SIZE (sizeof(size_t) + 14)
+
+int is_legacy_compressed(const void* data, size_t size);
+char* decompress_legacy(const char* compressed, size_t compressedSize, size_t* outputSize);
+
+/* Decoder used by decompress_with_options(); DECODE_SCAN is the original
+ * bit-at-a-time code table search, kept for benchmarking. DECODE_MULTI
+ * probes a table whose entries hold every short code that fits in the peek
+ * window, so one probe can give several symbols; payloads with codes
+ * longer than the window, and small ones, use DECODE_TABLE instead */
+enum huffman_decoder { DECODE_TABLE, DECODE_SCAN, DECODE_MULTI };
+
+/* Entropy coder for new blocks; decoding follows each block's type */
+enum entropy_codec { CODEC_HUFFMAN, CODEC_ANS };
+
+/* max_code_len caps code lengths (0 = HUFFMAN_MAX_BITS); the default matches the
+ * decoder's 11-bit peek window so every code resolves in one probe.
+ * block_size is the raw bytes per block and threads the number of
+ * worker threads for compressing and decoding blocks (0 = one per core).
+ * level sets the LZ77 match search effort, 1 to COMPRESS_LEVEL_MAX, and 0
+ * codes bytes with Huffman alone; a block keeps LZ77 only if it is smaller.
+ * streams is 1 or HUFFMAN_STREAMS bitstreams per Huffman payload; several
+ * streams let the decoder work on them at once. codec picks Huffman or
+ * tANS */
+#define COMPRESS_LEVEL_MAX     9
+#define COMPRESS_LEVEL_DEFAULT 3
+
+struct compress_options {
+    enum huffman_decoder decoder;
+    unsigned int max_code_len;
+    size_t block_size;
+    unsigned int threads;
+    unsigned int level;
+    unsigned int streams;
+    enum entropy_codec codec;
+};
+
+void compress_default_options(struct compress_options *opts);
+char* compress_with_options(const char* input, size_t* outputSize,
+                            const struct compress_options *opts);
+char* decompress_with_options(const char* compressed, size_t compressedSize,
+                              const struct compress_options *opts);
+
+/* Length-aware, binary-safe calls: the input may hold any bytes, and the
+ * output is exactly the compressed or original bytes with no NUL added.
+ * opts may be NULL for the defaults. The _buffer calls write into caller
+ * memory; when it is too small they fail and set *outputSize to the size
+ * needed. compress_bound() is enough for the default block size. */
+size_t compress_bound(size_t inputSize);
+char* compress_data(const void* input, size_t inputSize, size_t* outputSize,
+                    const struct compress_options *opts);
+int compress_buffer(const void* input, size_t inputSize, void* output, size_t outputCapacity,
+                    size_t* outputSize, const struct compress_options *opts);
+int decompressed_size(const void* compressed, size_t compressedSize, size_t* size);
+int decompress_buffer(const void* compressed, size_t compressedSize, void* output,
+                      size_t outputCapacity, size_t* outputSize,
+                      const struct compress_options *opts);
+
+/* Incremental codecs for the same format. Output goes to a sink callback
+ * that returns 0 on success; input can be written in pieces of any size */
+typedef int (*compress_sink)(void *ctx, const void *data, size_t len);
+
+struct compress_stream {
+    struct compress_options opts;
+    compress_sink sink;
+    void *ctx;
+    char *buffer;            /* one batch of blocks of input */
+    size_t buffered;
+    size_t capacity;
+    size_t block_size;
+    unsigned long long content_size;
+    unsigned long long total_in;
+};
+
+int compress_stream_init(struct compress_stream *cs, const struct compress_options *opts,
+                         unsigned long long content_size, compress_sink sink, void *ctx);
+int compress_stream_write(struct compress_stream *cs, const void *data, size_t len);
+int compress_stream_finish(struct compress_stream *cs);
+void compress_stream_free(struct compress_stream *cs);
+
+enum decompress_state { DSTREAM_HEADER, DSTREAM_FRAME, DSTREAM_PAYLOAD, DSTREAM_DONE };
+
+struct decompress_stream {
+    struct compress_options opts;
+    compress_sink sink;
+    void *ctx;
+    enum decompress_state state;
+    unsigned char *pending;  /* partial header, frame header or payload */
+    size_t pending_capacity;
+    size_t have;
+    size_t need;
+    size_t raw_len;
+    char *out;               /* one decoded block */
+    size_t out_capacity;
+    unsigned long long content_size;
+    unsigned long long produced;
+    int failed;
+};
+
+int decompress_stream_init(struct decompress_stream *ds, const struct compress_options *opts,
+                           compress_sink sink, void *ctx);
+int decompress_stream_write(struct decompress_stream *ds, const void *data, size_t len);
+int decompress_stream_finish(struct decompress_stream *ds);
+void decompress_stream_free(struct decompress_stream *ds);
+
 #endif
 
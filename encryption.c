@@ -13,17 +13,174 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>  
+#include <stdint.h>
 #include "encryption.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define XOR_HAVE_X86 1
+#endif
 
-void xorEncrypt(char* data, size_t dataSize, const char* key) {
-    size_t keyLen = strlen(key);
+/* Bytes the word and SIMD kernels take per step; the keystream is the key
+ * repeated out to keyLen + XOR_STEP bytes so any step can be loaded from it
+ * in one go, starting at the phase it has reached in the key */
+#define XOR_STEP 32
+#define XOR_STACK_KEY 256
+
+static enum xorKernel selectedKernel = XOR_KERNEL_AUTO;
+
+/* Original byte loop, kept as the fallback and for comparison */
+static void xorScalar(unsigned char* data, size_t dataSize, const unsigned char* key,
+                      size_t keyLen, size_t phase) {
     size_t i;
     for (i = 0; i < dataSize; i++) {
-        data[i] ^= key[i % keyLen]; 
-        /*xorDecrypt ^=, data[i] = data[i] ^ key[] */
-        /* Cycle through key*/
+        data[i] ^= key[(phase + i) % keyLen];
+    }
+}
+
+/* The kernels below XOR whole XOR_STEP chunks and leave the tail; *phase is
+ * where in the key the next byte falls */
+static size_t xorWords(unsigned char* data, size_t dataSize, const unsigned char* stream,
+                       size_t keyLen, size_t* phase) {
+    size_t step = XOR_STEP % keyLen;
+    size_t p = *phase;
+    size_t i, w;
+
+    for (i = 0; i + XOR_STEP <= dataSize; i += XOR_STEP) {
+        for (w = 0; w < XOR_STEP; w += 8) {
+            uint64_t a, b;
+            memcpy(&a, data + i + w, 8);
+            memcpy(&b, stream + p + w, 8);
+            a ^= b;
+            memcpy(data + i + w, &a, 8);
+        }
+        p += step;
+        if (p >= keyLen) p -= keyLen;
+    }
+    *phase = p;
+    return i;
+}
+
+#ifdef XOR_HAVE_X86
+static size_t xorSse2(unsigned char* data, size_t dataSize, const unsigned char* stream,
+                      size_t keyLen, size_t* phase) {
+    size_t step = XOR_STEP % keyLen;
+    size_t p = *phase;
+    size_t i;
+
+    for (i = 0; i + XOR_STEP <= dataSize; i += XOR_STEP) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(data + i + 16));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i*)(stream + p)));
+        b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i*)(stream + p + 16)));
+        _mm_storeu_si128((__m128i*)(data + i), a);
+        _mm_storeu_si128((__m128i*)(data + i + 16), b);
+        p += step;
+        if (p >= keyLen) p -= keyLen;
+    }
+    *phase = p;
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t xorAvx2(unsigned char* data, size_t dataSize, const unsigned char* stream,
+                      size_t keyLen, size_t* phase) {
+    size_t step = XOR_STEP % keyLen;
+    size_t p = *phase;
+    size_t i;
+
+    for (i = 0; i + XOR_STEP <= dataSize; i += XOR_STEP) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+        a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*)(stream + p)));
+        _mm256_storeu_si256((__m256i*)(data + i), a);
+        p += step;
+        if (p >= keyLen) p -= keyLen;
+    }
+    *phase = p;
+    return i;
+}
+#endif
+
+/* Best kernel this CPU runs */
+static enum xorKernel detectKernel(void) {
+#ifdef XOR_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return XOR_KERNEL_AVX2;
+    return XOR_KERNEL_SSE2;
+#else
+    return XOR_KERNEL_WORD;
+#endif
+}
+
+/* Picks the kernel xorEncrypt() uses; AUTO takes the best one the CPU has.
+ * Returns 0, or -1 if this build or CPU cannot run the one asked for */
+int xorSetKernel(enum xorKernel kernel) {
+    if (kernel == XOR_KERNEL_AUTO) {
+        kernel = detectKernel();
+    }
+#ifdef XOR_HAVE_X86
+    if (kernel == XOR_KERNEL_AVX2 && detectKernel() != XOR_KERNEL_AVX2) return -1;
+#else
+    if (kernel == XOR_KERNEL_SSE2 || kernel == XOR_KERNEL_AVX2) return -1;
+#endif
+    selectedKernel = kernel;
+    return 0;
+}
+
+enum xorKernel xorGetKernel(void) {
+    if (selectedKernel == XOR_KERNEL_AUTO) {
+        selectedKernel = detectKernel();
+    }
+    return selectedKernel;
+}
+
+/* XORs data with the key repeated from position phase of the key on */
+static void xorApply(unsigned char* data, size_t dataSize, const char* key, size_t phase) {
+    uint64_t stackStream[(XOR_STACK_KEY + XOR_STEP) / 8];
+    unsigned char* stream = (unsigned char*)stackStream;
+    enum xorKernel kernel = xorGetKernel();
+    size_t keyLen = strlen(key);
+    size_t done = 0;
+    size_t i;
+
+    if (keyLen == 0) return;
+    phase %= keyLen;
+    if (kernel == XOR_KERNEL_SCALAR || dataSize < XOR_STEP) {
+        xorScalar(data, dataSize, (const unsigned char*)key, keyLen, phase);
+        return;
+    }
+
+    /* Expand the key once into the repeating keystream */
+    if (keyLen > XOR_STACK_KEY) {
+        stream = malloc(keyLen + XOR_STEP);
+        if (!stream) {
+            xorScalar(data, dataSize, (const unsigned char*)key, keyLen, phase);
+            return;
+        }
+    }
+    for (i = 0; i < keyLen + XOR_STEP; i++) {
+        stream[i] = (unsigned char)key[i % keyLen];
     }
+
+    switch (kernel) {
+#ifdef XOR_HAVE_X86
+    case XOR_KERNEL_AVX2:
+        done = xorAvx2(data, dataSize, stream, keyLen, &phase);
+        break;
+    case XOR_KERNEL_SSE2:
+        done = xorSse2(data, dataSize, stream, keyLen, &phase);
+        break;
+#endif
+    default:
+        done = xorWords(data, dataSize, stream, keyLen, &phase);
+        break;
+    }
+    xorScalar(data + done, dataSize - done, stream, keyLen, phase);
+    if (stream != (unsigned char*)stackStream) free(stream);
+}
+
+void xorEncrypt(char* data, size_t dataSize, const char* key) {
+    xorApply((unsigned char*)data, dataSize, key, 0);
 }
 
 void xorDecrypt(char* data, size_t dataSize, const char* key) {
@@ -31,6 +188,155 @@ void xorDecrypt(char* data, size_t dataSize, const char* key) {
     xorEncrypt(data, dataSize, key);
 }
 
+/* The keystream byte for absolute position n is key[n % keyLen], so any
+ * piece of a buffer can be done on its own given where it starts */
+void xorEncryptAt(char* data, size_t dataSize, const char* key, unsigned long long offset) {
+    size_t keyLen = strlen(key);
+    if (keyLen == 0) return;
+    xorApply((unsigned char*)data, dataSize, key, (size_t)(offset % keyLen));
+}
+
+void xorDecryptAt(char* data, size_t dataSize, const char* key, unsigned long long offset) {
+    xorEncryptAt(data, dataSize, key, offset);
+}
+
+/* SHA-256 (FIPS 180-4), used only for the key check record */
+struct sha256 {
+    uint32_t state[8];
+    unsigned char block[64];
+    size_t used;
+    uint64_t total;
+};
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256Block(struct sha256* ctx, const unsigned char* p) {
+    uint32_t w[64], v[8];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[4 * i + 1] << 16) |
+               ((uint32_t)p[4 * i + 2] << 8) | (uint32_t)p[4 * i + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(v, ctx->state, sizeof(v));
+    for (i = 0; i < 64; i++) {
+        uint32_t s1 = ROTR32(v[4], 6) ^ ROTR32(v[4], 11) ^ ROTR32(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + sha256K[i] + w[i];
+        uint32_t s0 = ROTR32(v[0], 2) ^ ROTR32(v[0], 13) ^ ROTR32(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        memmove(v + 1, v, 7 * sizeof(v[0]));
+        v[4] += t1;
+        v[0] = t1 + s0 + maj;
+    }
+    for (i = 0; i < 8; i++) {
+        ctx->state[i] += v[i];
+    }
+}
+
+static void sha256Init(struct sha256* ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->used = 0;
+    ctx->total = 0;
+}
+
+static void sha256Update(struct sha256* ctx, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+
+    ctx->total += len;
+    while (len > 0) {
+        size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        len -= take;
+        if (ctx->used == 64) {
+            sha256Block(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static void sha256Final(struct sha256* ctx, unsigned char digest[32]) {
+    uint64_t bits = ctx->total * 8;
+    unsigned char pad = 0x80;
+    unsigned char length[8];
+    int i;
+
+    sha256Update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->used != 56) {
+        sha256Update(ctx, &pad, 1);
+    }
+    for (i = 0; i < 8; i++) {
+        length[i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    sha256Update(ctx, length, 8);
+    for (i = 0; i < 32; i++) {
+        digest[i] = (unsigned char)(ctx->state[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+/* Tag that proves a key without revealing it: the first KEY_CHECK_SIZE
+ * bytes of SHA-256 over a label, the salt and the key */
+void deriveKeyCheck(const char* key, const unsigned char* salt, unsigned char* check) {
+    static const char label[] = "diary key check v1";
+    unsigned char digest[32];
+    struct sha256 ctx;
+
+    sha256Init(&ctx);
+    sha256Update(&ctx, label, sizeof(label));
+    sha256Update(&ctx, salt, KEY_SALT_SIZE);
+    sha256Update(&ctx, key, strlen(key));
+    sha256Final(&ctx, digest);
+    memcpy(check, digest, KEY_CHECK_SIZE);
+}
+
+/* Compares two key checks without stopping at the first difference, so
+ * the time taken says nothing about how much of a guess was right */
+int keyCheckMatches(const unsigned char* a, const unsigned char* b) {
+    unsigned char diff = 0;
+    size_t i;
+    for (i = 0; i < KEY_CHECK_SIZE; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+/* Fresh salt from /dev/urandom, or from rand() where there is none */
+void generateSalt(unsigned char* salt) {
+    FILE* random = fopen("/dev/urandom", "rb");
+    size_t got = 0;
+    size_t i;
+
+    if (random) {
+        got = fread(salt, 1, KEY_SALT_SIZE, random);
+        fclose(random);
+    }
+    for (i = got; i < KEY_SALT_SIZE; i++) {
+        salt[i] = (unsigned char)rand();
+    }
+}
+
 char* generateKey(size_t keyLength) {
     if (keyLength == 0) return NULL; 
     char* key = malloc(keyLength + 1);
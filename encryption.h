@@ -4,8 +4,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+/* How xorEncrypt() does its XOR: the original byte loop, 64-bit words, or
+ * SSE2/AVX2 registers over a pre-expanded keystream. All give the same
+ * output; the default is the fastest the CPU supports */
+enum xorKernel { XOR_KERNEL_AUTO, XOR_KERNEL_SCALAR, XOR_KERNEL_WORD, XOR_KERNEL_SSE2, XOR_KERNEL_AVX2 };
+
+int xorSetKernel(enum xorKernel kernel);
+enum xorKernel xorGetKernel(void);
 void xorEncrypt(char* data, size_t dataSize, const char* key);
 void xorDecrypt(char* data, size_t dataSize, const char* key);
+
+/* Position-addressable forms: data holds the bytes found at offset of the
+ * whole stream, so a range can be en/decrypted without the rest */
+void xorEncryptAt(char* data, size_t dataSize, const char* key, unsigned long long offset);
+void xorDecryptAt(char* data, size_t dataSize, const char* key, unsigned long long offset);
+/* Key check record: a random salt and a tag derived from salt and key, so
+ * a wrong key is caught from a few header bytes */
+#define KEY_SALT_SIZE  16
+#define KEY_CHECK_SIZE 16
+
+void generateSalt(unsigned char* salt);
+void deriveKeyCheck(const char* key, const unsigned char* salt, unsigned char* check);
+int keyCheckMatches(const unsigned char* a, const unsigned char* b);
+
 char* generateKey(size_t keyLength);
 int validateKey(const char* key);
 
@@ -0,0 +1,321 @@
+/*
+ * LZ77 stage for the block coder: a hash-chain match finder splits a
+ * block into literal runs and (length, distance) matches, and lz_expand()
+ * rebuilds the block from them. The three byte streams it produces are
+ * Huffman coded by compression.c.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "lz77.h"
+
+#define HASH_BITS 15
+#define HASH_SIZE (1u << HASH_BITS)
+#define NO_POS    (-1)
+
+/* Chain entries searched per position and the match length at which the
+ * search stops early, by level */
+static const unsigned int chain_depth[LZ_LEVEL_MAX + 1] = {0, 4, 8, 16, 32, 32, 64, 128, 512, 4096};
+static const size_t nice_length[LZ_LEVEL_MAX + 1] = {0, 16, 32, 64, 64, 128, 128, 258, 1024, LZ_MAX_MATCH};
+
+struct match_finder {
+    const unsigned char *in;
+    size_t len;
+    int32_t *head;
+    int32_t *prev;
+    unsigned int depth;
+    size_t nice;
+};
+
+/* Growable output stream for one kind of token */
+struct token_stream {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static uint32_t hash4(const unsigned char *p) {
+    uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Number of equal leading bytes of a and b, up to limit; compares a word
+ * at a time where the first differing byte can be found from the XOR */
+static size_t match_length(const unsigned char *a, const unsigned char *b, size_t limit) {
+    size_t n = 0;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+    while (n + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + n, 8);
+        memcpy(&y, b + n, 8);
+        if (x != y) {
+            return n + (size_t)(__builtin_ctzll(x ^ y) >> 3);
+        }
+        n += 8;
+    }
+#endif
+    while (n < limit && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+/* Links pos into the chain of its hash */
+static void insert_position(struct match_finder *mf, size_t pos) {
+    uint32_t h;
+
+    if (pos + LZ_MIN_MATCH > mf->len) {
+        return;
+    }
+    h = hash4(mf->in + pos);
+    mf->prev[pos] = mf->head[h];
+    mf->head[h] = (int32_t)pos;
+}
+
+/* Longest earlier match for pos within the window; 0 if none reaches LZ_MIN_MATCH */
+static size_t find_match(const struct match_finder *mf, size_t pos, size_t *distance) {
+    const unsigned char *cur = mf->in + pos;
+    size_t limit = mf->len - pos;
+    size_t best = 0;
+    unsigned int depth = mf->depth;
+    int32_t cand;
+
+    if (limit < LZ_MIN_MATCH) {
+        return 0;
+    }
+    if (limit > LZ_MAX_MATCH) {
+        limit = LZ_MAX_MATCH;
+    }
+    cand = mf->head[hash4(cur)];
+    while (cand != NO_POS && depth-- > 0 && pos - (size_t)cand <= LZ_WINDOW) {
+        const unsigned char *match = mf->in + cand;
+
+        /* the byte that would extend the best match must agree first */
+        if (match[best] == cur[best]) {
+            size_t n = match_length(match, cur, limit);
+            if (n > best) {
+                best = n;
+                *distance = pos - (size_t)cand;
+                if (best >= mf->nice || best == limit) {
+                    break;
+                }
+            }
+        }
+        cand = mf->prev[cand];
+    }
+    return best >= LZ_MIN_MATCH ? best : 0;
+}
+
+static int stream_reserve(struct token_stream *ts, size_t extra) {
+    if (ts->capacity - ts->size < extra) {
+        size_t capacity = ts->capacity ? ts->capacity * 2 : 4096;
+        unsigned char *grown;
+
+        while (capacity - ts->size < extra) {
+            capacity *= 2;
+        }
+        grown = realloc(ts->data, capacity);
+        if (!grown) {
+            return -1;
+        }
+        ts->data = grown;
+        ts->capacity = capacity;
+    }
+    return 0;
+}
+
+/* Little-endian base-128 varint, 7 bits a byte */
+static int put_varint(struct token_stream *ts, size_t value) {
+    if (stream_reserve(ts, 10) != 0) {
+        return -1;
+    }
+    while (value >= 0x80) {
+        ts->data[ts->size++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    ts->data[ts->size++] = (unsigned char)value;
+    return 0;
+}
+
+static int get_varint(const unsigned char *buf, size_t size, size_t *pos, size_t *value) {
+    size_t v = 0;
+    unsigned int shift = 0;
+
+    while (*pos < size && shift < 35) {
+        unsigned char b = buf[(*pos)++];
+        v |= (size_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+
+/* Greedy or lazy parse of the whole block into seq and the token streams */
+static int parse_sequences(struct match_finder *mf, unsigned int level, struct lz_sequences *seq,
+                           struct token_stream *lengths, struct token_stream *distances) {
+    const unsigned char *in = mf->in;
+    size_t len = mf->len;
+    size_t pos = 0;
+    size_t literal_start = 0;
+    size_t i;
+
+    while (pos + LZ_MIN_MATCH <= len) {
+        size_t distance = 0;
+        size_t match_len = find_match(mf, pos, &distance);
+
+        insert_position(mf, pos);
+        if (match_len == 0) {
+            pos++;
+            continue;
+        }
+        /* a longer match one byte on is worth a literal */
+        while (level >= LZ_LAZY_LEVEL && match_len < mf->nice && pos + 1 + LZ_MIN_MATCH <= len) {
+            size_t next_distance = 0;
+            size_t next_len = find_match(mf, pos + 1, &next_distance);
+            if (next_len <= match_len) {
+                break;
+            }
+            pos++;
+            insert_position(mf, pos);
+            match_len = next_len;
+            distance = next_distance;
+        }
+
+        memcpy(seq->literals + seq->literal_count, in + literal_start, pos - literal_start);
+        seq->literal_count += pos - literal_start;
+        if (put_varint(lengths, pos - literal_start) != 0 ||
+            put_varint(lengths, match_len - LZ_MIN_MATCH) != 0 ||
+            put_varint(distances, distance) != 0) {
+            return -1;
+        }
+        seq->sequence_count++;
+        for (i = 1; i < match_len; i++) {
+            insert_position(mf, pos + i);
+        }
+        pos += match_len;
+        literal_start = pos;
+    }
+    memcpy(seq->literals + seq->literal_count, in + literal_start, len - literal_start);
+    seq->literal_count += len - literal_start;
+    return 0;
+}
+
+
+/******  *Function  : int lz_parse(const unsigned char *in, size_t len, unsigned int level, struct lz_sequences *seq)
+ *Description : splits a block into literal runs and matches
+ *Parameters : in, len - block data
+ *              level - 1 to LZ_LEVEL_MAX, search effort
+ *              seq - receives the malloc'd streams, free with lz_free()
+ *Effects : matches are greedy, or lazy by one byte from LZ_LAZY_LEVEL up
+ *Returned : 0 on success and -1 on fail
+ */
+
+int lz_parse(const unsigned char *in, size_t len, unsigned int level, struct lz_sequences *seq) {
+    struct match_finder mf;
+    struct token_stream lengths = {NULL, 0, 0};
+    struct token_stream distances = {NULL, 0, 0};
+    size_t i;
+    int result = -1;
+
+    memset(seq, 0, sizeof(*seq));
+    if (!in || level == 0 || len > INT32_MAX) {
+        return -1;
+    }
+    if (level > LZ_LEVEL_MAX) {
+        level = LZ_LEVEL_MAX;
+    }
+    mf.in = in;
+    mf.len = len;
+    mf.depth = chain_depth[level];
+    mf.nice = nice_length[level];
+    mf.head = malloc(HASH_SIZE * sizeof(*mf.head));
+    mf.prev = malloc((len ? len : 1) * sizeof(*mf.prev));
+    seq->literals = malloc(len ? len : 1);
+    if (mf.head && mf.prev && seq->literals) {
+        for (i = 0; i < HASH_SIZE; i++) {
+            mf.head[i] = NO_POS;
+        }
+        result = parse_sequences(&mf, level, seq, &lengths, &distances);
+    }
+
+    free(mf.head);
+    free(mf.prev);
+    seq->lengths = lengths.data;
+    seq->lengths_size = lengths.size;
+    seq->distances = distances.data;
+    seq->distances_size = distances.size;
+    if (result != 0) {
+        lz_free(seq);
+    }
+    return result;
+}
+
+
+/******  *Function  : int lz_expand(const struct lz_sequences *seq, unsigned char *out, size_t out_len)
+ *Description : rebuilds a block from its sequences
+ *Parameters : seq - streams as written by lz_parse()
+ *              out - receives exactly out_len bytes
+ *Effects : every run, length and distance is checked against the block
+ *Returned : 0 on success and -1 on corrupt sequences
+ */
+
+int lz_expand(const struct lz_sequences *seq, unsigned char *out, size_t out_len) {
+    size_t literal = 0;
+    size_t length_pos = 0;
+    size_t distance_pos = 0;
+    size_t pos = 0;
+    size_t s;
+
+    for (s = 0; s < seq->sequence_count; s++) {
+        size_t run, match_len, distance;
+
+        if (get_varint(seq->lengths, seq->lengths_size, &length_pos, &run) != 0 ||
+            get_varint(seq->lengths, seq->lengths_size, &length_pos, &match_len) != 0 ||
+            get_varint(seq->distances, seq->distances_size, &distance_pos, &distance) != 0) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (run > seq->literal_count - literal || run > out_len - pos) {
+            return -1;
+        }
+        memcpy(out + pos, seq->literals + literal, run);
+        literal += run;
+        pos += run;
+
+        if (distance == 0 || distance > pos || match_len > out_len - pos) {
+            return -1;
+        }
+        if (distance >= match_len) {
+            memcpy(out + pos, out + pos - distance, match_len);
+        } else {
+            /* overlapping copy repeats the last distance bytes */
+            const unsigned char *from = out + pos - distance;
+            size_t i;
+            for (i = 0; i < match_len; i++) {
+                out[pos + i] = from[i];
+            }
+        }
+        pos += match_len;
+    }
+    if (length_pos != seq->lengths_size || distance_pos != seq->distances_size ||
+        seq->literal_count - literal != out_len - pos) {
+        return -1;
+    }
+    memcpy(out + pos, seq->literals + literal, out_len - pos);
+    return 0;
+}
+
+void lz_free(struct lz_sequences *seq) {
+    free(seq->literals);
+    free(seq->lengths);
+    free(seq->distances);
+    seq->literals = NULL;
+    seq->lengths = NULL;
+    seq->distances = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef LZ77_H
+#define LZ77_H
+
+#include <stddef.h>
+
+/* Match finder levels: 0 turns the stage off, higher levels search longer
+ * hash chains and, from LZ_LAZY_LEVEL up, try one position ahead before
+ * taking a match */
+#define LZ_LEVEL_MAX     9
+#define LZ_LAZY_LEVEL    5
+#define LZ_MIN_MATCH     4
+#define LZ_MAX_MATCH     65536
+#define LZ_WINDOW        (1u << 16)
+
+/* A block split into sequences of (literal run, match). Each sequence is
+ * its literal run and match length minus LZ_MIN_MATCH as varints in
+ * lengths, and the match distance as a varint in distances. Literals past
+ * the last match are left over in literals after every run is taken. */
+struct lz_sequences {
+    unsigned char *literals;
+    size_t literal_count;
+    unsigned char *lengths;
+    size_t lengths_size;
+    unsigned char *distances;
+    size_t distances_size;
+    size_t sequence_count;
+};
+
+int lz_parse(const unsigned char *in, size_t len, unsigned int level, struct lz_sequences *seq);
+int lz_expand(const struct lz_sequences *seq, unsigned char *out, size_t out_len);
+void lz_free(struct lz_sequences *seq);
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * Small worker pool for the codec: parallel_for() runs a task for every
+ * index, with the calling thread and up to threads - 1 helpers pulling
+ * the next index from a shared counter.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "parallel.h"
+
+#define MAX_THREADS 64
+
+struct parallel_job {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t count;
+    parallel_task task;
+    void *ctx;
+};
+
+/* Number of online cores, at least 1 */
+unsigned int parallel_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1) {
+        return 1;
+    }
+    if (n > MAX_THREADS) {
+        return MAX_THREADS;
+    }
+    return (unsigned int)n;
+}
+
+/* Take indexes until there are none left */
+static void *parallel_worker(void *arg) {
+    struct parallel_job *job = (struct parallel_job *)arg;
+
+    for (;;) {
+        size_t index;
+
+        pthread_mutex_lock(&job->lock);
+        index = job->next;
+        if (index < job->count) {
+            job->next++;
+        }
+        pthread_mutex_unlock(&job->lock);
+
+        if (index >= job->count) {
+            return NULL;
+        }
+        job->task(job->ctx, index);
+    }
+}
+
+/* Run task for every index in [0, count); threads 0 means one per core.
+ * Returns 0 once every index has run, -1 on bad arguments. */
+int parallel_for(size_t count, unsigned int threads, parallel_task task, void *ctx) {
+    pthread_t helpers[MAX_THREADS];
+    struct parallel_job job;
+    unsigned int started = 0;
+    unsigned int i;
+
+    if (task == NULL) {
+        return -1;
+    }
+    if (threads == 0) {
+        threads = parallel_cpu_count();
+    }
+    if (threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
+    if ((size_t)threads > count) {
+        threads = (unsigned int)count;
+    }
+
+    if (threads <= 1) {
+        size_t index;
+        for (index = 0; index < count; index++) {
+            task(ctx, index);
+        }
+        return 0;
+    }
+
+    job.next = 0;
+    job.count = count;
+    job.task = task;
+    job.ctx = ctx;
+    if (pthread_mutex_init(&job.lock, NULL) != 0) {
+        return -1;
+    }
+
+    /* if a helper fails to start the remaining threads just do more of the work */
+    for (i = 0; i + 1 < threads; i++) {
+        if (pthread_create(&helpers[started], NULL, parallel_worker, &job) == 0) {
+            started++;
+        }
+    }
+    parallel_worker(&job);
+    for (i = 0; i < started; i++) {
+        pthread_join(helpers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    return 0;
+}
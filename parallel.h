@@ -0,0 +1,12 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+
+/* Work item callback: index runs from 0 to count - 1 */
+typedef void (*parallel_task)(void *ctx, size_t index);
+
+unsigned int parallel_cpu_count(void);
+int parallel_for(size_t count, unsigned int threads, parallel_task task, void *ctx);
+
+#endif